@@ -0,0 +1,379 @@
+//--------------------------------------------------------------------------
+// Benchmark harness for finddupe.  Generates a parameterized synthetic
+// directory tree (file count, size distribution, duplicate ratio,
+// hardlink density, directory fan-out) and runs timed scenarios over it,
+// reporting files/sec and MB/s per stage:
+//
+//   traversal   MyGlob linked in-process, counting names only
+//   signatures  finddupe -sigs        (enumerate + checksum every file)
+//   detection   finddupe              (signatures + full-file verification)
+//   eliminate   finddupe -del         (detection + duplicate removal),
+//                                     run on a freshly regenerated tree
+//
+// File contents are produced by a seeded xorshift generator, so the same
+// parameters always generate byte-identical trees and results are
+// comparable across builds.  The child stages measure the whole finddupe
+// process end to end; the first run after generation is cold-cache, so
+// compare like against like (or run twice and use the second number).
+//
+// Usage: bench [options] <scratchdir>
+//--------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <io.h>
+#define WIN32_LEAN_AND_MEAN
+#define _WIN32_WINNT 0x0600
+#include <windows.h>
+
+// From myglob.c
+int MyGlob(const WCHAR* Pattern, bool FollowReparse, void (*FileFuncParm)(const WCHAR* FileName));
+void MyGlobSetThreads(int NumThreads);
+
+static ULONGLONG NumFiles = 10000;   // -files
+static ULONGLONG MeanSizeKb = 16;    // -size
+static unsigned int DupePercent = 25;// -dupes
+static unsigned int LinkPercent = 0; // -links
+static unsigned int FanOut = 8;      // -fanout
+static ULONGLONG NumDirs = 0;        // -dirs (default: one per 100 files)
+static int Threads = 1;              // -t, passed through to finddupe
+static bool KeepTree = false;        // -keep
+static WCHAR* FinddupeExe = L"finddupe.exe"; // -exe
+static WCHAR* ScratchDir = NULL;
+
+static ULONGLONG TotalBytes;     // Bytes written into the generated tree.
+static ULONGLONG GeneratedFiles; // Files (including hardlinks) in the tree.
+static volatile LONG64 GlobCount;// Names seen by the traversal stage.
+
+//--------------------------------------------------------------------------
+// Deterministic pseudorandom stream.  One generator drives layout
+// decisions; per-file content streams are reseeded from the content id
+// so a duplicate reproduces its original byte for byte.
+//--------------------------------------------------------------------------
+static ULONGLONG XorshiftNext(ULONGLONG* State)
+{
+	ULONGLONG x = *State;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*State = x;
+	return x;
+}
+
+//--------------------------------------------------------------------------
+// Log-uniform file size between mean/8 and mean*8, at least one byte,
+// so the tree mixes small and multi-hundred-kB files like real corpora.
+//--------------------------------------------------------------------------
+static ULONGLONG PickFileSize(ULONGLONG* Rand)
+{
+	ULONGLONG Mean = MeanSizeKb * 1024, Lo = Mean / 8, Span;
+	if (Lo == 0)
+		Lo = 1;
+	// Six octave steps from mean/8 to mean*8; pick an octave, then a
+	// uniform offset inside it.
+	Span = Lo;
+	switch (XorshiftNext(Rand) % 6)
+	{
+	case 5: Span *= 2; Lo *= 32; break;
+	case 4: Span = Lo * 16; Lo *= 16; break;
+	case 3: Span = Lo * 8; Lo *= 8; break;
+	case 2: Span = Lo * 4; Lo *= 4; break;
+	case 1: Span = Lo * 2; Lo *= 2; break;
+	default: break;
+	}
+	return Lo + XorshiftNext(Rand) % (Span + 1);
+}
+
+//--------------------------------------------------------------------------
+// Write one file filled from the content stream for ContentId.
+//--------------------------------------------------------------------------
+static void WriteFileContents(const WCHAR* Name, ULONGLONG ContentId, ULONGLONG FileSize)
+{
+	static BYTE Buf[1 << 16];
+	ULONGLONG Stream = 0x9E3779B97F4A7C15ull * (ContentId + 1);
+	HANDLE File;
+	ULONGLONG BytesLeft = FileSize;
+
+	File = CreateFileW(Name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (File == INVALID_HANDLE_VALUE)
+	{
+		fwprintf(stderr, L"Could not create '%s'.\n", Name);
+		exit(EXIT_FAILURE);
+	}
+	while (BytesLeft)
+	{
+		DWORD Chunk = BytesLeft > sizeof(Buf) ? sizeof(Buf) : (DWORD)BytesLeft, Written;
+		DWORD a;
+		for (a = 0; a < Chunk; a += 8)
+			*(ULONGLONG*)(Buf + a) = XorshiftNext(&Stream); // Buf is 64k; no tail case.
+		if (!WriteFile(File, Buf, Chunk, &Written, NULL) || Written != Chunk)
+		{
+			fwprintf(stderr, L"Write to '%s' failed.\n", Name);
+			exit(EXIT_FAILURE);
+		}
+		BytesLeft -= Chunk;
+	}
+	CloseHandle(File);
+}
+
+//--------------------------------------------------------------------------
+// Generate the synthetic tree under ScratchDir.  Directory d is placed
+// under directory (d - 1) / FanOut, giving a tree whose depth follows
+// from -dirs and -fanout.  Files are distributed round robin.
+//--------------------------------------------------------------------------
+static void GenerateTree(void)
+{
+	ULONGLONG Rand = 0x2545F4914F6CDD1Dull;
+	WCHAR** DirPaths;
+	WCHAR Path[MAX_PATH * 2];
+	ULONGLONG* ContentIds; // Per real file, for duplicates to copy.
+	ULONGLONG* ContentSizes;
+	ULONGLONG d, f, NumReal = 0, LinkFailures = 0;
+
+	TotalBytes = 0;
+	GeneratedFiles = 0;
+
+	DirPaths = (WCHAR**)malloc(NumDirs * sizeof(WCHAR*));
+	ContentIds = (ULONGLONG*)malloc(NumFiles * sizeof(ULONGLONG));
+	ContentSizes = (ULONGLONG*)malloc(NumFiles * sizeof(ULONGLONG));
+	if (DirPaths == NULL || ContentIds == NULL || ContentSizes == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	CreateDirectoryW(ScratchDir, NULL);
+	for (d = 0; d < NumDirs; d++)
+	{
+		if (d == 0)
+			swprintf_s(Path, MAX_PATH * 2, L"%s", ScratchDir);
+		else
+			swprintf_s(Path, MAX_PATH * 2, L"%s\\d%llu", DirPaths[(d - 1) / FanOut], d);
+		DirPaths[d] = _wcsdup(Path);
+		if (DirPaths[d] == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (d != 0 && !CreateDirectoryW(DirPaths[d], NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			fwprintf(stderr, L"Could not create directory '%s'.\n", DirPaths[d]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (f = 0; f < NumFiles; f++)
+	{
+		unsigned int Roll = (unsigned int)(XorshiftNext(&Rand) % 100);
+		swprintf_s(Path, MAX_PATH * 2, L"%s\\f%llu.bin", DirPaths[f % NumDirs], f);
+
+		if (Roll < LinkPercent && NumReal > 0)
+		{
+			// Hardlink to an earlier real file.
+			ULONGLONG Target = XorshiftNext(&Rand) % NumReal;
+			WCHAR TargetPath[MAX_PATH * 2];
+			swprintf_s(TargetPath, MAX_PATH * 2, L"%s\\f%llu.bin", DirPaths[Target % NumDirs], Target);
+			if (CreateHardLinkW(Path, TargetPath, NULL))
+			{
+				GeneratedFiles += 1;
+				continue;
+			}
+			LinkFailures += 1; // Not NTFS, or link limit; fall through to a real file.
+		}
+
+		if (Roll < LinkPercent + DupePercent && NumReal > 0)
+		{
+			// Byte-identical copy of an earlier file's content stream.
+			ULONGLONG Of = XorshiftNext(&Rand) % NumReal;
+			ContentIds[f] = ContentIds[Of];
+			ContentSizes[f] = ContentSizes[Of];
+		}
+		else
+		{
+			ContentIds[f] = f;
+			ContentSizes[f] = PickFileSize(&Rand);
+		}
+		WriteFileContents(Path, ContentIds[f], ContentSizes[f]);
+		TotalBytes += ContentSizes[f];
+		GeneratedFiles += 1;
+		ContentIds[NumReal] = ContentIds[f];
+		ContentSizes[NumReal] = ContentSizes[f];
+		NumReal += 1;
+	}
+
+	if (LinkFailures)
+		fwprintf(stderr, L"Warning: %llu hardlink creations failed; plain files were generated instead.\n", LinkFailures);
+
+	for (d = 0; d < NumDirs; d++)
+		free(DirPaths[d]);
+	free(DirPaths);
+	free(ContentIds);
+	free(ContentSizes);
+}
+
+//--------------------------------------------------------------------------
+// Remove the generated tree with "cmd /c rd /s /q".
+//--------------------------------------------------------------------------
+static void RemoveTree(void)
+{
+	WCHAR Cmd[MAX_PATH * 2];
+	swprintf_s(Cmd, MAX_PATH * 2, L"cmd /c rd /s /q \"%s\"", ScratchDir);
+	_wsystem(Cmd);
+}
+
+//--------------------------------------------------------------------------
+// Print one result line.  Pass Bytes = 0 for stages where MB/s is not
+// meaningful (traversal reads no file contents).
+//--------------------------------------------------------------------------
+static void ReportStage(const WCHAR* Stage, double Seconds, ULONGLONG Files, ULONGLONG Bytes)
+{
+	wprintf(L"%-12s %8.2f s %12.0f files/s", Stage, Seconds, Seconds > 0 ? Files / Seconds : 0);
+	if (Bytes)
+		wprintf(L" %10.1f MB/s", Seconds > 0 ? Bytes / Seconds / 1e6 : 0);
+	wprintf(L"\n");
+}
+
+static void CountFile(const WCHAR* FileName)
+{
+	(void)FileName;
+	InterlockedIncrement64(&GlobCount);
+}
+
+//--------------------------------------------------------------------------
+// Run one finddupe scenario with stdout discarded (console output speed
+// must not contaminate the measurement) and return the elapsed seconds.
+//--------------------------------------------------------------------------
+static double RunFinddupe(const WCHAR* ExtraArgs)
+{
+	WCHAR CmdLine[MAX_PATH * 4];
+	STARTUPINFOW si = { sizeof(si) };
+	PROCESS_INFORMATION pi;
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+	HANDLE Nul;
+	LARGE_INTEGER Freq, Start, End;
+	DWORD ExitCode = 0;
+
+	swprintf_s(CmdLine, MAX_PATH * 4, L"\"%s\" -p -t %d %s \"%s\\**\"",
+		FinddupeExe, Threads, ExtraArgs, ScratchDir);
+
+	Nul = CreateFileW(L"NUL", GENERIC_WRITE, FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = Nul;
+	si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	QueryPerformanceFrequency(&Freq);
+	QueryPerformanceCounter(&Start);
+	if (!CreateProcessW(NULL, CmdLine, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+	{
+		fwprintf(stderr, L"Could not run '%s'. Use -exe to point at finddupe.exe.\n", CmdLine);
+		exit(EXIT_FAILURE);
+	}
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	QueryPerformanceCounter(&End);
+	GetExitCodeProcess(pi.hProcess, &ExitCode);
+	CloseHandle(pi.hProcess);
+	CloseHandle(pi.hThread);
+	if (Nul != INVALID_HANDLE_VALUE)
+		CloseHandle(Nul);
+	if (ExitCode != 0)
+	{
+		fwprintf(stderr, L"'%s' exited with code %lu.\n", CmdLine, ExitCode);
+		exit(EXIT_FAILURE);
+	}
+	return (double)(End.QuadPart - Start.QuadPart) / Freq.QuadPart;
+}
+
+static void Usage(void)
+{
+	fwprintf(stderr, L"bench - finddupe benchmark harness\n\n"
+		L"Usage: bench [options] <scratchdir>\n\n"
+		L"Options:\n"
+		L" -files <N>  Number of files to generate (default 10000)\n"
+		L" -size <kB>  Mean file size; sizes spread log-uniform mean/8..mean*8 (default 16)\n"
+		L" -dupes <P>  Percent of files that are byte-identical duplicates (default 25)\n"
+		L" -links <P>  Percent of files that are hardlinks to earlier files (default 0)\n"
+		L" -dirs <N>   Number of directories (default: one per 100 files)\n"
+		L" -fanout <N> Subdirectories per directory (default 8)\n"
+		L" -t <N>      Worker threads passed to finddupe and MyGlob (default 1)\n"
+		L" -exe <path> Path to finddupe.exe (default: found on PATH)\n"
+		L" -keep       Keep the generated tree after the run\n");
+	exit(EXIT_FAILURE);
+}
+
+int wmain(int argc, WCHAR** argv)
+{
+	int argn;
+	WCHAR Pattern[MAX_PATH * 2];
+	LARGE_INTEGER Freq, Start, End;
+	double Seconds;
+
+	for (argn = 1; argn < argc; argn++)
+	{
+		WCHAR* arg = argv[argn];
+		if (arg[0] != L'-')
+		{
+			if (ScratchDir != NULL)
+				Usage();
+			ScratchDir = arg;
+		}
+		else if (!wcscmp(arg, L"-files") && argn + 1 < argc)
+			NumFiles = _wcstoui64(argv[++argn], NULL, 10);
+		else if (!wcscmp(arg, L"-size") && argn + 1 < argc)
+			MeanSizeKb = _wcstoui64(argv[++argn], NULL, 10);
+		else if (!wcscmp(arg, L"-dupes") && argn + 1 < argc)
+			DupePercent = (unsigned int)_wtoi(argv[++argn]);
+		else if (!wcscmp(arg, L"-links") && argn + 1 < argc)
+			LinkPercent = (unsigned int)_wtoi(argv[++argn]);
+		else if (!wcscmp(arg, L"-dirs") && argn + 1 < argc)
+			NumDirs = _wcstoui64(argv[++argn], NULL, 10);
+		else if (!wcscmp(arg, L"-fanout") && argn + 1 < argc)
+			FanOut = (unsigned int)_wtoi(argv[++argn]);
+		else if (!wcscmp(arg, L"-t") && argn + 1 < argc)
+			Threads = _wtoi(argv[++argn]);
+		else if (!wcscmp(arg, L"-exe") && argn + 1 < argc)
+			FinddupeExe = argv[++argn];
+		else if (!wcscmp(arg, L"-keep"))
+			KeepTree = true;
+		else
+			Usage();
+	}
+	if (ScratchDir == NULL || NumFiles == 0 || DupePercent + LinkPercent > 100 || FanOut == 0 || Threads < 1)
+		Usage();
+	if (NumDirs == 0)
+		NumDirs = NumFiles / 100 + 1;
+
+	wprintf(L"Generating %llu files (~%llu kB mean, %u%% dupes, %u%% links) in %llu directories under '%s'...\n",
+		NumFiles, MeanSizeKb, DupePercent, LinkPercent, NumDirs, ScratchDir);
+	GenerateTree();
+	wprintf(L"Corpus: %llu files, %llu MB\n\n", GeneratedFiles, TotalBytes / 1000000);
+
+	QueryPerformanceFrequency(&Freq);
+
+	// Stage 1: directory traversal, in-process through MyGlob.
+	swprintf_s(Pattern, MAX_PATH * 2, L"%s\\**", ScratchDir);
+	MyGlobSetThreads(Threads);
+	GlobCount = 0;
+	QueryPerformanceCounter(&Start);
+	MyGlob(Pattern, false, CountFile);
+	QueryPerformanceCounter(&End);
+	Seconds = (double)(End.QuadPart - Start.QuadPart) / Freq.QuadPart;
+	ReportStage(L"traversal", Seconds, (ULONGLONG)GlobCount, 0);
+
+	// Stage 2: enumeration plus signature computation, no verification.
+	ReportStage(L"signatures", RunFinddupe(L"-sigs"), GeneratedFiles, TotalBytes);
+
+	// Stage 3: full detection (signatures, index, full-file verification).
+	ReportStage(L"detection", RunFinddupe(L""), GeneratedFiles, TotalBytes);
+
+	// Stage 4: detection plus elimination, on a fresh identical tree so
+	// the -del pass sees the same duplicates detection just counted.
+	RemoveTree();
+	GenerateTree();
+	ReportStage(L"eliminate", RunFinddupe(L"-del"), GeneratedFiles, TotalBytes);
+
+	if (!KeepTree)
+		RemoveTree();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,225 @@
+//--------------------------------------------------------------------------------
+// Binary dedup plan support for the -plan / -apply split.
+//
+// With -plan, the scan records its confirmed actions (delete the duplicate,
+// optionally hardlink it back to the keeper) in a compact binary file instead
+// of executing them or emitting a cmd.exe batch file.  A later -apply run
+// executes the plan in-process with direct DeleteFileW/CreateHardLinkW calls,
+// revalidating each duplicate cheaply by size and NTFS file id so a file that
+// changed since the scan is skipped rather than destroyed.
+//
+// Record writing happens from EliminateDuplicate, which runs under the index
+// lock, so no locking is needed here.
+//
+// ElemenTP 2022
+//--------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/utime.h>
+#define WIN32_LEAN_AND_MEAN // To keep windows.h bloat down.
+#include <windows.h>
+
+#define PLAN_MAGIC "FDPL"
+#define PLAN_VERSION 1
+#define PLAN_FLAG_HARDLINK 1 // Relink duplicates to the keeper; otherwise just delete.
+
+// Fixed part of one plan record; the keeper and duplicate paths follow,
+// counted in WCHARs, not null terminated.
+typedef struct
+{
+	ULONGLONG FileSize;
+	DWORD IndexHigh, IndexLow; // NTFS file id of the duplicate at scan time.
+	DWORD Attributes;          // Duplicate's attributes, restored after relinking.
+	__time64_t Mtime;
+	DWORD KeeperChars;
+	DWORD DupeChars;
+} PlanRecord_t;
+
+static FILE* PlanFile;
+static unsigned int PlanFlags;
+static ULONGLONG PlanCount;
+
+//--------------------------------------------------------------------------------
+// Create the plan file and write a header with a zero count; the real
+// count is patched in by PlanClose.
+//--------------------------------------------------------------------------------
+void PlanOpen(const WCHAR* PlanFileName, bool MakeHardLinks)
+{
+	unsigned int Version = PLAN_VERSION;
+
+	_wfopen_s(&PlanFile, PlanFileName, L"wb");
+	if (PlanFile == NULL)
+	{
+		fwprintf(stderr, L"Unable to create plan file '%s'.\n", PlanFileName);
+		exit(EXIT_FAILURE);
+	}
+	PlanFlags = MakeHardLinks ? PLAN_FLAG_HARDLINK : 0;
+	PlanCount = 0;
+	fwrite(PLAN_MAGIC, 1, 4, PlanFile);
+	fwrite(&Version, sizeof(Version), 1, PlanFile);
+	fwrite(&PlanFlags, sizeof(PlanFlags), 1, PlanFile);
+	fwrite(&PlanCount, sizeof(PlanCount), 1, PlanFile);
+}
+
+//--------------------------------------------------------------------------------
+// Append one confirmed action to the plan.
+//--------------------------------------------------------------------------------
+void PlanAddAction(const WCHAR* KeeperName, const WCHAR* DupeName, ULONGLONG FileSize,
+	DWORD IndexHigh, DWORD IndexLow, DWORD Attributes, __time64_t Mtime)
+{
+	PlanRecord_t Record;
+
+	Record.FileSize = FileSize;
+	Record.IndexHigh = IndexHigh;
+	Record.IndexLow = IndexLow;
+	Record.Attributes = Attributes;
+	Record.Mtime = Mtime;
+	Record.KeeperChars = (DWORD)wcslen(KeeperName);
+	Record.DupeChars = (DWORD)wcslen(DupeName);
+	fwrite(&Record, sizeof(Record), 1, PlanFile);
+	fwrite(KeeperName, sizeof(WCHAR), Record.KeeperChars, PlanFile);
+	fwrite(DupeName, sizeof(WCHAR), Record.DupeChars, PlanFile);
+	PlanCount += 1;
+}
+
+//--------------------------------------------------------------------------------
+// Patch the final record count into the header and close the plan.
+//--------------------------------------------------------------------------------
+void PlanClose(void)
+{
+	if (PlanFile == NULL)
+		return;
+	fseek(PlanFile, 4 + 2 * sizeof(unsigned int), SEEK_SET);
+	fwrite(&PlanCount, sizeof(PlanCount), 1, PlanFile);
+	fclose(PlanFile);
+	PlanFile = NULL;
+	wprintf(L"Plan written: %llu actions.\n", PlanCount);
+}
+
+//--------------------------------------------------------------------------------
+// Check that the duplicate still is the file the scan saw: same size and
+// same NTFS file id.  Anything changed (or unreadable) means skip.
+//--------------------------------------------------------------------------------
+static bool RevalidateDupe(const WCHAR* DupeName, const PlanRecord_t* Record)
+{
+	HANDLE File;
+	BY_HANDLE_FILE_INFORMATION FileInfo;
+	bool Ok = false;
+
+	File = CreateFileW(DupeName, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if (File == INVALID_HANDLE_VALUE)
+		return false;
+	if (GetFileInformationByHandle(File, &FileInfo))
+	{
+		Ok = FileInfo.nFileIndexHigh == Record->IndexHigh
+			&& FileInfo.nFileIndexLow == Record->IndexLow
+			&& (((ULONGLONG)FileInfo.nFileSizeHigh << 32) | FileInfo.nFileSizeLow) == Record->FileSize;
+	}
+	CloseHandle(File);
+	return Ok;
+}
+
+//--------------------------------------------------------------------------------
+// Execute a plan file.  Returns a process exit code.
+//--------------------------------------------------------------------------------
+int PlanApply(const WCHAR* PlanFileName)
+{
+	FILE* File = NULL;
+	char Magic[4];
+	unsigned int Version, Flags;
+	ULONGLONG Count, a, Applied = 0, Skipped = 0;
+	WCHAR KeeperName[_MAX_PATH * 2], DupeName[_MAX_PATH * 2];
+
+	_wfopen_s(&File, PlanFileName, L"rb");
+	if (File == NULL)
+	{
+		fwprintf(stderr, L"Unable to open plan file '%s'.\n", PlanFileName);
+		return EXIT_FAILURE;
+	}
+	if (fread(Magic, 1, 4, File) != 4 || memcmp(Magic, PLAN_MAGIC, 4) != 0
+		|| fread(&Version, sizeof(Version), 1, File) != 1 || Version != PLAN_VERSION
+		|| fread(&Flags, sizeof(Flags), 1, File) != 1
+		|| fread(&Count, sizeof(Count), 1, File) != 1)
+	{
+		fclose(File);
+		fwprintf(stderr, L"'%s' is not a finddupe plan file.\n", PlanFileName);
+		return EXIT_FAILURE;
+	}
+
+	for (a = 0; a < Count; a++)
+	{
+		PlanRecord_t Record;
+		WIN32_FILE_ATTRIBUTE_DATA KeeperAttr;
+
+		if (fread(&Record, sizeof(Record), 1, File) != 1
+			|| Record.KeeperChars >= _MAX_PATH * 2 || Record.DupeChars >= _MAX_PATH * 2
+			|| fread(KeeperName, sizeof(WCHAR), Record.KeeperChars, File) != Record.KeeperChars
+			|| fread(DupeName, sizeof(WCHAR), Record.DupeChars, File) != Record.DupeChars)
+		{
+			fclose(File);
+			fwprintf(stderr, L"Plan file '%s' is truncated or corrupt.\n", PlanFileName);
+			return EXIT_FAILURE;
+		}
+		KeeperName[Record.KeeperChars] = L'\0';
+		DupeName[Record.DupeChars] = L'\0';
+
+		// Cheap revalidation; a duplicate or keeper that changed since the
+		// scan is skipped rather than destroyed.
+		if (!RevalidateDupe(DupeName, &Record))
+		{
+			fwprintf(stderr, L"Skipping '%s': changed since the plan was made.\n", DupeName);
+			Skipped += 1;
+			continue;
+		}
+		if (!GetFileAttributesExW(KeeperName, GetFileExInfoStandard, &KeeperAttr)
+			|| (((ULONGLONG)KeeperAttr.nFileSizeHigh << 32) | KeeperAttr.nFileSizeLow) != Record.FileSize)
+		{
+			fwprintf(stderr, L"Skipping '%s': keeper '%s' changed since the plan was made.\n", DupeName, KeeperName);
+			Skipped += 1;
+			continue;
+		}
+
+		if (Record.Attributes & FILE_ATTRIBUTE_READONLY)
+			SetFileAttributesW(DupeName, Record.Attributes & ~FILE_ATTRIBUTE_READONLY);
+
+		if (!DeleteFileW(DupeName))
+		{
+			fclose(File);
+			fwprintf(stderr, L"Delete of '%s' failed.\n", DupeName);
+			return EXIT_FAILURE;
+		}
+
+		if (Flags & PLAN_FLAG_HARDLINK)
+		{
+			if (CreateHardLinkW(DupeName, KeeperName, NULL) == 0)
+			{
+				// Uh-oh.  Better stop before we mess up more stuff!
+				fclose(File);
+				fwprintf(stderr, L"Create hard link from '%s' to '%s' failed.\n", KeeperName, DupeName);
+				return EXIT_FAILURE;
+			}
+
+			// Restore attributes and time on the new link.
+			SetFileAttributesW(DupeName, Record.Attributes);
+			{
+				struct __utimbuf64 mtime = { 0,0 };
+				mtime.actime = Record.Mtime;
+				mtime.modtime = Record.Mtime;
+#pragma warning(disable:6031)
+				_wutime64(DupeName, &mtime);
+			}
+		}
+		Applied += 1;
+	}
+	fclose(File);
+
+	wprintf(L"Plan applied: %llu of %llu actions done", Applied, Count);
+	if (Skipped)
+		wprintf(L", %llu skipped", Skipped);
+	wprintf(L".\n");
+	return EXIT_SUCCESS;
+}
@@ -27,6 +27,9 @@
 #define _WIN32_WINNT 0x0600
 #include <windows.h>
 #include <direct.h>
+#include <intrin.h>
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
 
 #define S_IWUSR 0x80 // user has write permission
 #define S_IWGRP 0x10 // group has write permission
@@ -40,6 +43,8 @@ typedef struct
 	unsigned int Sum;
 } Checksum_t;
 
+#define FULL_HASH_SIZE 32
+
 // Data structure for file allcoations:
 typedef struct
 {
@@ -50,16 +55,28 @@ typedef struct
 		DWORD Low;
 	} FileIndex;
 	DWORD NumLinks;
+	DWORD Attributes;  // From GetFileInformationByHandle at scan time.
+	__time64_t Mtime;
 	ULONGLONG FileSize;
 	WCHAR* FileName;
-	size_t Larger;  // Child index for larger child
-	size_t Smaller; // Child index for smaller child
-	size_t Same;
+	bool IsReference;  // File came from a -ref pattern; never eliminate it.
+	BYTE* FullHash;    // Whole-file SHA-256, allocated when computed (-fullhash only).
+	size_t Same;       // Chain of entries sharing this checksum.
 } FileData_t;
 static FileData_t* FileData;
 static size_t NumAllocated = 1024;
 static size_t NumUnique = 1;
 
+// Open addressing hash index over the stored checksums.  Each used slot
+// holds the FileData index of a chain head in CkIndex, with the head's
+// checksum duplicated in CkSums at the same slot, so the probe loop
+// compares against one dense 8-byte-per-slot array and never touches a
+// scattered FileData record until the checksum actually matches.  Slot
+// value 0 means empty (FileData[0] is never used).
+static size_t* CkIndex;
+static Checksum_t* CkSums;
+static size_t CkIndexSize;
+
 // Duplicate statistics summary
 struct
 {
@@ -72,6 +89,27 @@ struct
 	ULONGLONG DuplicateBytes;
 } DupeStats;
 
+// Per-stage profiling counters for -stats.  Counters on hot paths are
+// plain increments (the locked paths already hold a lock; the scan
+// worker counters use interlocked adds); wall time is only sampled at
+// the phase boundaries in wmain, not per file.
+struct
+{
+	ULONGLONG CollectTicks;      // Wall time of the traversal phase (QPC ticks).
+	ULONGLONG ScanTicks;         // Wall time of the checksum/eliminate phase.
+	ULONGLONG FilesFound;        // Files collected by traversal.
+	volatile LONGLONG SigFilesRead;  // Files whose signature came from a read.
+	volatile LONGLONG SigBytesRead;  // Bytes read for signatures.
+	volatile LONGLONG SigCacheHits;  // Signatures taken from the -cache file.
+	volatile LONGLONG LinkSigHits;   // Signatures inherited from a hardlink.
+	ULONGLONG IndexLookups;      // CheckDuplicate calls.
+	ULONGLONG IndexProbes;       // Slots examined across all lookups.
+	ULONGLONG ComparePairs;      // Candidate pairs content-compared.
+	ULONGLONG CompareBytes;      // Bytes read or mapped by those compares.
+	ULONGLONG FullHashFiles;     // Files hashed in -fullhash mode.
+	ULONGLONG FullHashBytes;
+} ScanStats;
+
 // How many bytes to calculate file signature of.
 #define BYTES_DO_CHECKSUM_OF 32768
 #define CHUNK_SIZE 0x10000
@@ -80,6 +118,9 @@ struct
 FILE* BatchFile = NULL; // Output a batch file
 WCHAR* BatchFileName = NULL;
 
+FILE* OutFile = NULL; // Machine readable duplicate report (-out)
+WCHAR* OutFileName = NULL;
+
 bool PrintFileSigs = false;            // Print signatures of files
 bool PrintDuplicates = true;           // Print duplicates
 bool MakeHardLinks = false;            // Do the actual hard linking
@@ -93,8 +134,118 @@ bool HideCantReadMessage = false;      // Hide the can't read file error
 bool SkipZeroLength = true;            // Ignore zero length files.
 bool ProgressIndicatorVisible = false; // Weither a progress indicator needs to be overwritten.
 bool FollowReparse = false;            // Wether to follow reparse points (like unix softlinks for NTFS)
+int ThreadCount = 1;                   // Number of checksum worker threads (-t option)
+bool LegacySigs = false;               // Force the original byte-wise signature kernel
+bool FullHashMode = false;             // Verify duplicates by full-file SHA-256 (-fullhash)
+bool UseMftScan = false;               // Enumerate whole-volume patterns from the NTFS MFT (-mft)
+ULONGLONG KeeperCacheBudget = 0;       // Keeper content cache budget in bytes (-cachemem, 0 = off)
+bool ShowStats = false;                // Print per-stage counters and timings (-stats)
+bool ClusterMode = false;              // Report duplicate clusters by reclaimable bytes (-clusters)
+
+// Arena for path strings owned by the scan session.  Paths are allocated
+// once in phase one, never freed individually, and shared by the pending
+// list and FileData, so a bump allocator in megabyte slabs replaces tens
+// of millions of tiny mallocs.  Only ever used under the collect lock.
+typedef struct StrSlab
+{
+	struct StrSlab* Next;
+	size_t Used;     // WCHARs handed out from this slab.
+	size_t Capacity; // WCHARs available in this slab.
+} StrSlab_t;
+#define STR_SLAB_CHARS (1 << 19) // 1 MB of WCHARs per slab.
+static StrSlab_t* StrSlabs;
+
+//--------------------------------------------------------------------------
+// Copy a string into the arena.
+//--------------------------------------------------------------------------
+static WCHAR* StrArenaDup(const WCHAR* Str)
+{
+	size_t Chars = wcslen(Str) + 1;
+	WCHAR* Out;
+
+	if (StrSlabs == NULL || StrSlabs->Used + Chars > StrSlabs->Capacity)
+	{
+		size_t AllocChars = Chars > STR_SLAB_CHARS ? Chars : STR_SLAB_CHARS;
+		StrSlab_t* Slab = (StrSlab_t*)malloc(sizeof(StrSlab_t) + AllocChars * sizeof(WCHAR));
+		if (Slab == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		Slab->Next = StrSlabs;
+		Slab->Used = 0;
+		Slab->Capacity = AllocChars;
+		StrSlabs = Slab;
+	}
+
+	Out = (WCHAR*)(StrSlabs + 1) + StrSlabs->Used;
+	memcpy(Out, Str, Chars * sizeof(WCHAR));
+	StrSlabs->Used += Chars;
+	return Out;
+}
+
+// Phase one of the scan only stats files and records one of these per match;
+// phase two checksums just the entries whose size bucket has two or more
+// members, since a file with a unique size can never be a duplicate.
+typedef struct
+{
+	WCHAR* FileName;
+	ULONGLONG FileSize;
+	__time64_t Mtime;
+	bool IsReference;
+	unsigned int PatternOrdinal; // Which command line pattern found it.
+} PendingFile_t;
+static PendingFile_t* PendingFiles;
+static size_t NumPending, PendingAllocated;
+
+// Open addressing count-per-size table used to find the singleton sizes.
+static ULONGLONG* SizeKeys;
+static unsigned int* SizeCounts;
+static size_t SizeTableSize, SizeTableUsed;
+
+// Work queue for handing pending files from the phase two driver to the
+// checksum worker threads.  Bounded so the driver cannot run away from
+// slow checksumming.
+#define WORK_QUEUE_DEPTH 1024
+static PendingFile_t* WorkQueue[WORK_QUEUE_DEPTH];
+static size_t QueueHead, QueueTail, QueueCount;
+static int QueueBusyWorkers;
+static bool QueueClosed;
+static CRITICAL_SECTION QueueLock;
+static CONDITION_VARIABLE QueueNotEmpty, QueueNotFull, QueueIdle;
+static CRITICAL_SECTION IndexLock; // Guards FileData, DupeStats and duplicate elimination.
+static CRITICAL_SECTION CollectLock; // Guards phase one state when traversal is parallel.
+static CRITICAL_SECTION MftEnumLock; // The MFT enumerator keeps module state; one volume at a time.
+static HANDLE* WorkerThreads;
+static unsigned int CurrentPatternOrdinal;
+
+WCHAR* SigCacheFileName = NULL;        // On disk signature cache (-cache option)
+WCHAR* PlanFileName = NULL;            // Record actions to a binary plan (-plan option)
+WCHAR* ApplyFileName = NULL;           // Execute a previously written plan (-apply option)
+WCHAR* RefIndexFileName = NULL;        // Serialized reference index (-refindex option)
+WCHAR* CheckpointFileName = NULL;      // Periodic scan snapshot for resume (-checkpoint option)
+static void CheckpointNoteDeleted(const WCHAR* FileName); // Resume fingerprints must skip deleted files.
 
 int MyGlob(const WCHAR* Pattern, bool FollowReparse, void (*FileFuncParm)(const WCHAR* FileName));
+void MyGlobSetThreads(int NumThreads);
+
+// From mftenum.c
+int MyMftEnum(WCHAR Drive, void (*FileFuncParm)(const WCHAR* FileName));
+
+// From sigcache.c
+bool SigCacheLookup(const WCHAR* Path, ULONGLONG FileSize, __time64_t Mtime,
+	DWORD IndexHigh, DWORD IndexLow, unsigned int* Crc, unsigned int* Sum);
+void SigCacheStore(const WCHAR* Path, ULONGLONG FileSize, __time64_t Mtime,
+	DWORD IndexHigh, DWORD IndexLow, unsigned int Crc, unsigned int Sum);
+void SigCacheLoad(const WCHAR* CacheFileName, bool LegacyKernel);
+void SigCacheSave(const WCHAR* CacheFileName, bool LegacyKernel);
+
+// From dedupplan.c
+void PlanOpen(const WCHAR* PlanFileName, bool MakeHardLinks);
+void PlanAddAction(const WCHAR* KeeperName, const WCHAR* DupeName, ULONGLONG FileSize,
+	DWORD IndexHigh, DWORD IndexLow, DWORD Attributes, __time64_t Mtime);
+void PlanClose(void);
+int PlanApply(const WCHAR* PlanFileName);
 
 //--------------------------------------------------------------------------
 // Calculate some 64-bit file signature.  CRC and a checksum
@@ -116,6 +267,51 @@ static void CalcCrc(Checksum_t* Check, BYTE* Data, ULONGLONG NumBytes)
 	Check->Sum = Sum;
 }
 
+//--------------------------------------------------------------------------
+// Hardware accelerated signature kernel using the SSE4.2 CRC32 instruction,
+// eight bytes per step.  Signatures differ from the legacy kernel (use
+// -legacysigs for the old ones), but any one run is self-consistent, which
+// is all duplicate detection needs.
+//--------------------------------------------------------------------------
+static void CalcCrcHw(Checksum_t* Check, BYTE* Data, ULONGLONG NumBytes)
+{
+	ULONGLONG a = 0;
+	ULONGLONG Crc = Check->Crc;
+	ULONGLONG Sum = Check->Sum;
+	for (; a + 8 <= NumBytes; a += 8)
+	{
+		ULONGLONG Word;
+		memcpy(&Word, Data + a, 8); // Unaligned safe; compiles to one load.
+		Crc = _mm_crc32_u64(Crc, Word);
+		Sum += Word;
+	}
+	for (; a < NumBytes; a++)
+	{
+		Crc = _mm_crc32_u8((unsigned int)Crc, Data[a]);
+		Sum += Data[a];
+	}
+	Check->Crc = (unsigned int)Crc;
+	Check->Sum = (unsigned int)(Sum ^ (Sum >> 32));
+}
+
+// Signature kernel used by the scan, selected once at startup by CPUID.
+static void (*CalcSignature)(Checksum_t* Check, BYTE* Data, ULONGLONG NumBytes) = CalcCrc;
+
+//--------------------------------------------------------------------------
+// Pick the fastest signature kernel the CPU supports.
+//--------------------------------------------------------------------------
+static void SelectSignatureKernel(void)
+{
+	int CpuInfo[4];
+	if (LegacySigs)
+		return;
+	__cpuid(CpuInfo, 1);
+	if (CpuInfo[2] & (1 << 20)) // SSE4.2
+	{
+		CalcSignature = CalcCrcHw;
+	}
+}
+
 //--------------------------------------------------------------------------
 // Clear line (erase the progress indicator)
 //--------------------------------------------------------------------------
@@ -128,6 +324,93 @@ void ClearProgressInd(void)
 	}
 }
 
+// Asynchronous progress reporter.  The scan threads only bump counters
+// (and publish the latest file name); this thread wakes twice a second
+// and renders the indicator with current throughput.  It is the only
+// place that formats or flushes progress output, which keeps timing and
+// console calls off the per-file paths entirely.
+static HANDLE ProgressThread;
+static volatile bool ProgressStopFlag;
+static volatile LONGLONG ProgressPhase;        // 0 = collecting, 1 = checking.
+static const WCHAR* volatile ProgressFileName; // Last collected file (arena string).
+static volatile LONGLONG ProgressDone;         // Files dispatched in phase two.
+static volatile LONGLONG ProgressBytes;        // Their combined sizes.
+static volatile LONGLONG ProgressTotal;        // Phase two file count.
+
+static unsigned __stdcall ProgressReporter(void* arg)
+{
+	ULONGLONG PhaseStart = GetTickCount64();
+	LONGLONG LastPhase = 0;
+	(void)arg;
+
+	for (;;)
+	{
+		double Elapsed;
+
+		Sleep(500);
+		if (ProgressStopFlag)
+			break;
+		if (ProgressPhase != LastPhase)
+		{
+			LastPhase = ProgressPhase;
+			PhaseStart = GetTickCount64();
+		}
+		Elapsed = (GetTickCount64() - PhaseStart) / 1000.0;
+		if (Elapsed <= 0)
+			continue;
+
+		if (LastPhase == 0)
+		{
+			// Counter and name reads are racy by design; a slightly stale
+			// indicator is fine.
+			const WCHAR* Name = ProgressFileName;
+			WCHAR ShowName[105];
+			size_t l = Name ? wcslen(Name) : 0;
+			memset(ShowName, L'\0', sizeof(ShowName));
+			if (l > 100)
+				l = 101;
+			if (Name)
+				memcpy(ShowName, Name, l * sizeof(WCHAR));
+			if (l >= 101)
+				memcpy(ShowName + 100, L"...", 4 * sizeof(WCHAR));
+			ClearProgressInd();
+			wprintf(L"Scanned %llu files (%.0f files/sec): %ls",
+				ScanStats.FilesFound, ScanStats.FilesFound / Elapsed, ShowName);
+		}
+		else
+		{
+			LONGLONG Done = ProgressDone, Total = ProgressTotal;
+			double Rate = Done / Elapsed;
+			double MbPerSec = ProgressBytes / (1024.0 * 1024.0) / Elapsed;
+			int EtaSecs = Rate > 0 ? (int)((Total - Done) / Rate) : 0;
+			ClearProgressInd();
+			wprintf(L"Checking file %lld of %lld (%.0f files/sec, %.1f MB/s, ETA %d:%02d)",
+				Done, Total, Rate, MbPerSec, EtaSecs / 60, EtaSecs % 60);
+		}
+		ProgressIndicatorVisible = true;
+		fflush(stdout);
+	}
+	return 0;
+}
+
+static void StartProgressReporter(void)
+{
+	if (!ShowProgress)
+		return;
+	ProgressThread = (HANDLE)_beginthreadex(NULL, 0, ProgressReporter, NULL, 0, NULL);
+}
+
+static void StopProgressReporter(void)
+{
+	if (ProgressThread == NULL)
+		return;
+	ProgressStopFlag = true;
+	WaitForSingleObject(ProgressThread, INFINITE);
+	CloseHandle(ProgressThread);
+	ProgressThread = NULL;
+	ClearProgressInd();
+}
+
 //--------------------------------------------------------------------------
 // Escape names for batch files: % turns into %%
 //--------------------------------------------------------------------------
@@ -148,272 +431,1011 @@ WCHAR* EscapeBatchName(WCHAR* Name)
 	return EscName;
 }
 
-enum EDRes
+//--------------------------------------------------------------------------
+// Background executor for confirmed -hardlink / -del actions.  Executing
+// the delete/link/attribute syscalls inline serialized them with the
+// scan; on runs replacing 100k duplicates that action tail takes as long
+// as detection itself.  Confirmed actions are queued here instead (the
+// paths are arena strings, stable for the run, and attributes and mtime
+// were captured from the scan handle, so nothing is re-statted) and a
+// dedicated thread executes them while detection continues.  A failed
+// action stops the executor from touching further files - same policy
+// as the old inline hard exit - but the scan drains cleanly before the
+// process reports the failure.
+//--------------------------------------------------------------------------
+typedef struct
 {
-	EDR_NOT_DUPE,
-	EDR_HDLINK_LIMIT,
-	EDR_SKIP_RO,
-	EDR_NO_OP,
-	EDR_DELETE,
-	EDR_HDLINK
-};
+	const WCHAR* DupeName;   // File to replace or remove.
+	const WCHAR* KeeperName; // Surviving copy to link to.
+	DWORD Attributes;
+	__time64_t Mtime;
+	bool MakeLink;
+} DupeAction_t;
+
+static DupeAction_t* ActionQueue;
+static size_t ActionQueueHead, ActionQueueCount, ActionQueueAlloc;
+static CRITICAL_SECTION ActionLock;
+static CONDITION_VARIABLE ActionWork, ActionIdle;
+static HANDLE ActionThread;
+static bool ActionStopFlag;
+static bool ActionBusy;
+static bool ActionFailed;
+static ULONGLONG ActionsDone;
 
 //--------------------------------------------------------------------------
-// Eliminate duplicates.
+// Execute one queued action: strip the readonly bit if needed, delete,
+// optionally relink, restore attributes and time on the new link.
 //--------------------------------------------------------------------------
-static enum EDRes EliminateDuplicate(FileData_t ThisFile, FileData_t DupeOf)
+static void ExecuteAction(const DupeAction_t* Action)
 {
-	// First compare whole file.  If mismatch, return 0.
-	bool IsDuplicate = true;
-	bool Hardlinked = false;
-	bool IsReadonly = false;
-
-	if (ThisFile.FileSize != DupeOf.FileSize)
-		return EDR_NOT_DUPE;
-
-	if (DupeOf.NumLinks > 0 && memcmp(&ThisFile.FileIndex, &DupeOf.FileIndex, sizeof(DupeOf.FileIndex)) == 0)
+	if (Action->Attributes & FILE_ATTRIBUTE_READONLY)
 	{
-		Hardlinked = true;
-		goto dont_read;
+		// Make file writable so we can delete it.
+		// We sort of assume we own the file.  Otherwise, not much we can do.
+		SetFileAttributesW(Action->DupeName, Action->Attributes & ~FILE_ATTRIBUTE_READONLY);
 	}
 
-	FILE* File1 = NULL, * File2 = NULL;
-	_wfopen_s(&File1, ThisFile.FileName, L"rb");
-	if (File1 == NULL)
-	{
-		fwprintf(stderr, L"Open file %s failure.\n", ThisFile.FileName);
-		exit(EXIT_FAILURE);
-	}
-	_wfopen_s(&File2, DupeOf.FileName, L"rb");
-	if (File2 == NULL)
+	if (_wunlink(Action->DupeName))
 	{
-		fclose(File1);
-		fwprintf(stderr, L"Open file %s failure.\n", DupeOf.FileName);
-		exit(EXIT_FAILURE);
+		ClearProgressInd();
+		fwprintf(stderr, L"Delete of '%s' failed.\n", Action->DupeName);
+		ActionFailed = true;
+		return;
 	}
 
-	size_t BytesLeft = ThisFile.FileSize, BytesToRead = 0;
-	BYTE* Buf1 = (BYTE*)malloc(CHUNK_SIZE * 2);
-	if (Buf1 == NULL)
-	{
-		fwprintf(stderr, L"Malloc failure.\n");
-		exit(EXIT_FAILURE);
-	}
-	BYTE* Buf2 = Buf1 + CHUNK_SIZE;
-	while (BytesLeft)
+	if (Action->MakeLink)
 	{
-		BytesToRead = BytesLeft;
-		if (BytesToRead > CHUNK_SIZE)
-			BytesToRead = CHUNK_SIZE;
-
-		if (fread(Buf1, 1, BytesToRead, File1) != BytesToRead)
+		if (CreateHardLinkW(Action->DupeName, Action->KeeperName, NULL) == 0)
 		{
+			// Uh-oh.  Better stop before we mess up more stuff!
 			ClearProgressInd();
-			fwprintf(stderr, L"Error doing full file read on '%s'\n", ThisFile.FileName);
+			fwprintf(stderr, L"Create hard link from '%s' to '%s' failed.\n", Action->KeeperName, Action->DupeName);
+			ActionFailed = true;
+			return;
 		}
 
-		if (fread(Buf2, 1, BytesToRead, File2) != BytesToRead)
+		// Restore attributes and time on the new link.
+		SetFileAttributesW(Action->DupeName, Action->Attributes);
 		{
-			ClearProgressInd();
-			fwprintf(stderr, L"Error doing full file read on '%s'\n", DupeOf.FileName);
+			struct __utimbuf64 mtime = { 0,0 };
+			mtime.actime = Action->Mtime;
+			mtime.modtime = Action->Mtime;
+#pragma warning(disable:6031)
+			_wutime64(Action->DupeName, &mtime);
 		}
+	}
+	ActionsDone += 1;
+}
 
-		BytesLeft -= BytesToRead;
+//--------------------------------------------------------------------------
+// Executor thread.  Pops actions until the queue is closed and empty.
+//--------------------------------------------------------------------------
+static unsigned __stdcall ActionExecutor(void* arg)
+{
+	(void)arg;
+	for (;;)
+	{
+		DupeAction_t Action;
 
-		if (memcmp(Buf1, Buf2, BytesToRead))
+		EnterCriticalSection(&ActionLock);
+		while (ActionQueueCount == 0 && !ActionStopFlag)
+			SleepConditionVariableCS(&ActionWork, &ActionLock, INFINITE);
+		if (ActionQueueCount == 0)
 		{
-			IsDuplicate = false;
+			LeaveCriticalSection(&ActionLock);
 			break;
 		}
+		Action = ActionQueue[ActionQueueHead];
+		ActionQueueHead += 1;
+		ActionQueueCount -= 1;
+		if (ActionQueueCount == 0)
+			ActionQueueHead = 0; // Drained; refill the array from the start.
+		ActionBusy = true;
+		LeaveCriticalSection(&ActionLock);
+
+		if (!ActionFailed) // After a failure, drain without touching more files.
+			ExecuteAction(&Action);
+
+		EnterCriticalSection(&ActionLock);
+		ActionBusy = false;
+		if (ActionQueueCount == 0)
+			WakeAllConditionVariable(&ActionIdle);
+		LeaveCriticalSection(&ActionLock);
 	}
+	return 0;
+}
 
-	fclose(File1);
-	fclose(File2);
-	free(Buf1);
+//--------------------------------------------------------------------------
+// Queue one confirmed action.  Called under the index lock.
+//--------------------------------------------------------------------------
+static void ActionQueuePush(const WCHAR* DupeName, const WCHAR* KeeperName,
+	DWORD Attributes, __time64_t Mtime, bool MakeLink)
+{
+	DupeAction_t* Action;
 
-	if (!IsDuplicate)
+	EnterCriticalSection(&ActionLock);
+	if (ActionQueueHead + ActionQueueCount >= ActionQueueAlloc)
 	{
-		// Full file duplicate check failed (CRC collision, or differs only after 32k)
-		return EDR_NOT_DUPE;
+		ActionQueueAlloc = ActionQueueAlloc + 1024 + ActionQueueAlloc / 2;
+#pragma warning(disable:6308)
+		ActionQueue = (DupeAction_t*)realloc(ActionQueue, ActionQueueAlloc * sizeof(DupeAction_t));
+		if (ActionQueue == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
 	}
+	Action = &ActionQueue[ActionQueueHead + ActionQueueCount];
+	Action->DupeName = DupeName;
+	Action->KeeperName = KeeperName;
+	Action->Attributes = Attributes;
+	Action->Mtime = Mtime;
+	Action->MakeLink = MakeLink;
+	ActionQueueCount += 1;
+	LeaveCriticalSection(&ActionLock);
+	WakeConditionVariable(&ActionWork);
+}
 
-	DupeStats.DuplicateFiles += 1;
-	DupeStats.DuplicateBytes += ThisFile.FileSize;
+//--------------------------------------------------------------------------
+// Wait until every queued action has been executed.
+//--------------------------------------------------------------------------
+static void ActionQueueDrain(void)
+{
+	if (ActionThread == NULL)
+		return;
+	EnterCriticalSection(&ActionLock);
+	while (ActionQueueCount != 0 || ActionBusy)
+		SleepConditionVariableCS(&ActionIdle, &ActionLock, INFINITE);
+	LeaveCriticalSection(&ActionLock);
+}
 
-dont_read:
-	if (PrintDuplicates && !HardlinkSearchMode)
+static void StartActionExecutor(void)
+{
+	InitializeCriticalSection(&ActionLock);
+	InitializeConditionVariable(&ActionWork);
+	InitializeConditionVariable(&ActionIdle);
+	ActionThread = (HANDLE)_beginthreadex(NULL, 0, ActionExecutor, NULL, 0, NULL);
+	if (ActionThread == NULL)
 	{
-		ClearProgressInd();
-		wprintf(L"Duplicate: '%s'\n", DupeOf.FileName);
-		wprintf(L"With:      '%s'\n", ThisFile.FileName);
-		if (Hardlinked)
-		{
-			// If the files happen to be hardlinked, show that.
-			wprintf(L"    (hardlinked instances of same file)\n");
-		}
+		fwprintf(stderr, L"Could not start action executor thread.\n");
+		exit(EXIT_FAILURE);
 	}
+}
 
-	if (!MakeHardLinks && !DelDuplicates)
+static void StopActionExecutor(void)
+{
+	if (ActionThread == NULL)
+		return;
+	EnterCriticalSection(&ActionLock);
+	ActionStopFlag = true;
+	LeaveCriticalSection(&ActionLock);
+	WakeAllConditionVariable(&ActionWork);
+	WaitForSingleObject(ActionThread, INFINITE);
+	CloseHandle(ActionThread);
+	ActionThread = NULL;
+}
+
+enum EDRes
+{
+	EDR_NOT_DUPE,
+	EDR_HDLINK_LIMIT,
+	EDR_SKIP_RO,
+	EDR_NO_OP,
+	EDR_DELETE,
+	EDR_HDLINK
+};
+
+// Sliding view granularity for the memory mapped compare.
+#define MAP_WINDOW_SIZE (4 << 20)
+
+//--------------------------------------------------------------------------
+// Compare one window of two mapped files.  Returns false if the views
+// could not be mapped; clears *Match if the window contents differ.
+//--------------------------------------------------------------------------
+static bool CompareMapWindow(HANDLE Map1, HANDLE Map2, ULONGLONG Offset, SIZE_T ViewBytes, bool* Match)
+{
+	BYTE* View1, * View2;
+	int Diff;
+
+	View1 = (BYTE*)MapViewOfFile(Map1, FILE_MAP_READ, (DWORD)(Offset >> 32), (DWORD)Offset, ViewBytes);
+	if (View1 == NULL)
+		return false;
+	View2 = (BYTE*)MapViewOfFile(Map2, FILE_MAP_READ, (DWORD)(Offset >> 32), (DWORD)Offset, ViewBytes);
+	if (View2 == NULL)
 	{
-		return EDR_NO_OP;
+		UnmapViewOfFile(View1);
+		return false;
 	}
 
-	struct _stat64 FileStat;
-	if (_wstat64(ThisFile.FileName, &FileStat) != 0)
+	Diff = memcmp(View1, View2, ViewBytes);
+	UnmapViewOfFile(View1);
+	UnmapViewOfFile(View2);
+
+	if (Diff)
+		*Match = false;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+// Compare two files byte for byte through memory mapped sliding windows,
+// so the compare reads straight out of the page cache with no copies.
+// Returns false if the files could not be mapped (caller falls back to
+// buffered reads); on success *Match says whether the contents are equal.
+//
+// Near-duplicate pairs that survive the signature check typically diverge
+// near the end (growing logs, appended databases), so the last window and
+// a few stratified interior windows are probed first; a pair that differs
+// there is rejected after a handful of seeks instead of a sequential read
+// of nearly the whole file.  Only pairs that really match pay for reading
+// every window.
+//--------------------------------------------------------------------------
+static bool CompareFilesMapped(const WCHAR* Name1, const WCHAR* Name2, ULONGLONG FileSize, bool* Match)
+{
+	HANDLE File1 = INVALID_HANDLE_VALUE, File2 = INVALID_HANDLE_VALUE;
+	HANDLE Map1 = NULL, Map2 = NULL;
+	ULONGLONG NumWindows, Window, Probes[4];
+	size_t NumProbes = 0, p;
+	bool Ok = false;
+	*Match = true;
+
+	File1 = CreateFileW(Name1, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File1 == INVALID_HANDLE_VALUE)
+		goto out;
+	File2 = CreateFileW(Name2, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File2 == INVALID_HANDLE_VALUE)
+		goto out;
+	Map1 = CreateFileMappingW(File1, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (Map1 == NULL)
+		goto out;
+	Map2 = CreateFileMappingW(File2, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (Map2 == NULL)
+		goto out;
+
+	NumWindows = (FileSize + MAP_WINDOW_SIZE - 1) / MAP_WINDOW_SIZE;
+	if (NumWindows > 1)
+		Probes[NumProbes++] = NumWindows - 1; // Tail first; most frequent divergence point.
+	if (NumWindows > 2)
+		Probes[NumProbes++] = NumWindows / 2;
+	if (NumWindows > 4)
 	{
-		// oops!
-		fwprintf(stderr, L"Stat failed on '%s'.\n", ThisFile.FileName);
-		exit(EXIT_FAILURE);
+		Probes[NumProbes++] = NumWindows / 4;
+		Probes[NumProbes++] = (NumWindows * 3) / 4;
 	}
-	IsReadonly = (FileStat.st_mode & S_IWUSR) ? false : true;
 
-	if (IsReadonly)
+	for (Window = 0; Window < NumWindows + NumProbes; Window++)
 	{
-		// Readonly file.
-		if (!DoReadonly)
+		ULONGLONG Offset;
+		SIZE_T ViewBytes = MAP_WINDOW_SIZE;
+		ULONGLONG w;
+
+		if (Window < NumProbes)
 		{
-			ClearProgressInd();
-			wprintf(L"Skipping duplicate readonly file '%s'.\n", ThisFile.FileName);
-			return EDR_SKIP_RO;
+			w = Probes[Window];
 		}
-		if (MakeHardLinks || DelDuplicates)
+		else
 		{
-			// Make file read/write so we can delete it.
-			// We sort of assume we own the file.  Otherwise, not much we can do.
-#pragma warning(disable:6031)
-			_wchmod(ThisFile.FileName, FileStat.st_mode | S_IWUSR);
+			// Sequential fill of whatever the probes did not cover.
+			w = Window - NumProbes;
+			for (p = 0; p < NumProbes; p++)
+				if (Probes[p] == w)
+					break;
+			if (p < NumProbes)
+				continue;
 		}
+
+		Offset = w * MAP_WINDOW_SIZE;
+		if (FileSize - Offset < ViewBytes)
+			ViewBytes = (SIZE_T)(FileSize - Offset);
+		if (!CompareMapWindow(Map1, Map2, Offset, ViewBytes, Match))
+			goto out;
+		ScanStats.CompareBytes += ViewBytes * 2;
+		if (!*Match)
+			break;
 	}
+	Ok = true;
+
+out:
+	if (Map1)
+		CloseHandle(Map1);
+	if (Map2)
+		CloseHandle(Map2);
+	if (File1 != INVALID_HANDLE_VALUE)
+		CloseHandle(File1);
+	if (File2 != INVALID_HANDLE_VALUE)
+		CloseHandle(File2);
+	return Ok;
+}
 
-	if (MakeHardLinks)
-	{
-		if (Hardlinked)
-			return EDR_NO_OP; // Nothign to do.
+// Files at or above this size are compared with unbuffered reads, so a
+// multi-gigabyte compare streams past the page cache instead of evicting
+// the directory metadata and small files the rest of the scan depends on.
+#define NOBUF_COMPARE_THRESHOLD (256ull << 20)
+// Read granularity of the unbuffered compare.  A multiple of every real
+// sector size, so reads stay aligned.
+#define NOBUF_CHUNK_SIZE (4 << 20)
 
-		if (DupeOf.NumLinks >= 1023)
-		{
-			// Do not link more than 1023 files onto one physical file (windows limit)
-			ClearProgressInd();
-			wprintf(L"Skipping hardlinking '%s' and '%s', number of links of '%s' has reach limit.\n", ThisFile.FileName, DupeOf.FileName, DupeOf.FileName);
-			return EDR_HDLINK_LIMIT;
-		}
-	}
+// Two NOBUF_CHUNK_SIZE buffers from VirtualAlloc (page aligned, as
+// FILE_FLAG_NO_BUFFERING requires), allocated once and reused across
+// compares; EliminateDuplicate runs under the index lock.
+static BYTE* NoBufPool;
 
-	if (BatchFile)
-	{
-		fprintf(BatchFile, "del %s \"%ls\"\n", IsReadonly ? "/F" : "", EscapeBatchName(ThisFile.FileName));
-	}
-	else
+//--------------------------------------------------------------------------
+// Read and compare one aligned chunk of two unbuffered files.  Positioned
+// synchronous reads; requesting a whole chunk at the tail is fine, the
+// read just comes back short at EOF.  Returns false on a read failure;
+// clears *Match if the chunk contents differ.
+//--------------------------------------------------------------------------
+static bool NoBufCompareChunk(HANDLE File1, HANDLE File2, ULONGLONG Offset, ULONGLONG FileSize, bool* Match)
+{
+	OVERLAPPED Pos1, Pos2;
+	DWORD Got1 = 0, Got2 = 0;
+	SIZE_T Expected = NOBUF_CHUNK_SIZE;
+
+	if (FileSize - Offset < Expected)
+		Expected = (SIZE_T)(FileSize - Offset);
+
+	memset(&Pos1, 0, sizeof(Pos1));
+	Pos1.Offset = (DWORD)Offset;
+	Pos1.OffsetHigh = (DWORD)(Offset >> 32);
+	Pos2 = Pos1;
+
+	if (!ReadFile(File1, NoBufPool, NOBUF_CHUNK_SIZE, &Got1, &Pos1) || Got1 < Expected)
+		return false;
+	if (!ReadFile(File2, NoBufPool + NOBUF_CHUNK_SIZE, NOBUF_CHUNK_SIZE, &Got2, &Pos2) || Got2 < Expected)
+		return false;
+
+	ScanStats.CompareBytes += Expected * 2;
+	if (memcmp(NoBufPool, NoBufPool + NOBUF_CHUNK_SIZE, Expected))
+		*Match = false;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+// Compare two huge files byte for byte with FILE_FLAG_NO_BUFFERING, so the
+// reads bypass the page cache entirely - a mapped or buffered compare of a
+// multi-gigabyte pair flushes everything else out of the cache and the
+// traversal slows to a crawl right after it.  The tail chunk is probed
+// first, same rationale as the mapped compare.  Returns false if the files
+// could not be opened or read this way (caller falls back to the mapped
+// compare); on success *Match says whether the contents are equal.
+//--------------------------------------------------------------------------
+static bool CompareFilesUnbuffered(const WCHAR* Name1, const WCHAR* Name2, ULONGLONG FileSize, bool* Match)
+{
+	HANDLE File1 = INVALID_HANDLE_VALUE, File2 = INVALID_HANDLE_VALUE;
+	ULONGLONG NumChunks, Chunk;
+	bool Ok = false;
+	*Match = true;
+
+	File1 = CreateFileW(Name1, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File1 == INVALID_HANDLE_VALUE)
+		goto out;
+	File2 = CreateFileW(Name2, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File2 == INVALID_HANDLE_VALUE)
+		goto out;
+
+	if (NoBufPool == NULL)
 	{
-		if (_wunlink(ThisFile.FileName))
+		NoBufPool = (BYTE*)VirtualAlloc(NULL, NOBUF_CHUNK_SIZE * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (NoBufPool == NULL)
 		{
-			ClearProgressInd();
-			fwprintf(stderr, L"Delete of '%s' failed.\n", DupeOf.FileName);
+			fwprintf(stderr, L"Malloc failure.\n");
 			exit(EXIT_FAILURE);
 		}
 	}
 
-	if (MakeHardLinks)
+	NumChunks = (FileSize + NOBUF_CHUNK_SIZE - 1) / NOBUF_CHUNK_SIZE;
+	if (NumChunks > 1)
 	{
-		if (BatchFile)
+		// Tail first; most frequent divergence point.
+		if (!NoBufCompareChunk(File1, File2, (NumChunks - 1) * NOBUF_CHUNK_SIZE, FileSize, Match))
+			goto out;
+		if (!*Match)
 		{
-			fprintf(BatchFile, "fsutil hardlink create \"%ls\" ", EscapeBatchName(ThisFile.FileName));
-			fprintf(BatchFile, "\"%ls\"\n", EscapeBatchName(DupeOf.FileName));
-			if (IsReadonly)
-			{
-				// If original was readonly, restore that attribute
-				fprintf(BatchFile, "attrib +r \"%ls\"\n", EscapeBatchName(ThisFile.FileName));
-			}
-			ClearProgressInd();
-			wprintf(L"    Added hardlink creation command to the batch file.\n");
+			Ok = true;
+			goto out;
 		}
-		else
-		{
-			if (CreateHardLinkW(ThisFile.FileName, DupeOf.FileName, NULL) == 0)
-			{
-				// Uh-oh.  Better stop before we mess up more stuff!
-				ClearProgressInd();
-				fwprintf(stderr, L"Create hard link from '%s' to '%s' failed.\n", DupeOf.FileName, ThisFile.FileName);
-				exit(EXIT_FAILURE);
-			}
+	}
+	for (Chunk = 0; Chunk < NumChunks; Chunk++)
+	{
+		if (NumChunks > 1 && Chunk == NumChunks - 1)
+			break; // Already compared as the tail probe.
+		if (!NoBufCompareChunk(File1, File2, Chunk * NOBUF_CHUNK_SIZE, FileSize, Match))
+			goto out;
+		if (!*Match)
+			break;
+	}
+	Ok = true;
+
+out:
+	if (File1 != INVALID_HANDLE_VALUE)
+		CloseHandle(File1);
+	if (File2 != INVALID_HANDLE_VALUE)
+		CloseHandle(File2);
+	return Ok;
+}
 
-			{
-				// set Unix access rights and time to new file
-				_wchmod(ThisFile.FileName, FileStat.st_mode);
+// In-memory cache of keeper file contents (-cachemem).  A keeper at the
+// head of a duplicate cluster is compared against every later candidate,
+// so its contents are read once into this cache and the second through
+// Nth compares read only the candidate side from disk.  Least recently
+// used keepers are evicted when the byte budget is exceeded.  Only ever
+// used under the index lock, like everything else in the eliminate path.
+typedef struct
+{
+	const WCHAR* FileName; // Arena string owned by the scan; stable for the run.
+	BYTE* Data;
+	ULONGLONG Size;
+	ULONGLONG LastUse;
+} KeeperEntry_t;
+static KeeperEntry_t* KeeperCache;
+static size_t KeeperCacheCount, KeeperCacheAlloc;
+static ULONGLONG KeeperCacheBytes, KeeperCacheTick;
 
-				struct __utimbuf64 mtime = { 0,0 };
-				mtime.actime = FileStat.st_mtime;
-				mtime.modtime = FileStat.st_mtime;
+//--------------------------------------------------------------------------
+// Fetch a keeper's contents from the cache, reading and inserting them on
+// a miss.  Returns NULL if the keeper cannot be read or held in memory;
+// the caller then compares both sides from disk as before.
+//--------------------------------------------------------------------------
+static BYTE* KeeperCacheGet(const WCHAR* FileName, ULONGLONG FileSize)
+{
+	size_t a, Victim;
+	FILE* File = NULL;
+	BYTE* Data;
+	KeeperEntry_t* Entry;
 
-				// Set mod time to original file's
-				_wutime64(ThisFile.FileName, &mtime);
-			}
-			ClearProgressInd();
-			wprintf(L"    Created hardlink.\n");
+	KeeperCacheTick += 1;
+	for (a = 0; a < KeeperCacheCount; a++)
+	{
+		if (KeeperCache[a].FileName == FileName)
+		{
+			KeeperCache[a].LastUse = KeeperCacheTick;
+			return KeeperCache[a].Data;
 		}
-		return EDR_HDLINK;
 	}
-	else
+
+	Data = (BYTE*)malloc((size_t)FileSize);
+	if (Data == NULL)
+		return NULL; // Out of memory here is not fatal; just skip the cache.
+	_wfopen_s(&File, FileName, L"rb");
+	if (File == NULL)
 	{
-		if (BatchFile)
+		free(Data);
+		return NULL;
+	}
+	if (fread(Data, 1, (size_t)FileSize, File) != FileSize)
+	{
+		fclose(File);
+		free(Data);
+		return NULL;
+	}
+	fclose(File);
+
+	// Evict least recently used keepers until the new one fits.
+	while (KeeperCacheBytes + FileSize > KeeperCacheBudget && KeeperCacheCount > 0)
+	{
+		Victim = 0;
+		for (a = 1; a < KeeperCacheCount; a++)
 		{
-			ClearProgressInd();
-			wprintf(L"    Added delete command to the batch file.\n");
+			if (KeeperCache[a].LastUse < KeeperCache[Victim].LastUse)
+				Victim = a;
 		}
-		else
+		free(KeeperCache[Victim].Data);
+		KeeperCacheBytes -= KeeperCache[Victim].Size;
+		KeeperCache[Victim] = KeeperCache[KeeperCacheCount - 1];
+		KeeperCacheCount -= 1;
+	}
+
+	if (KeeperCacheCount >= KeeperCacheAlloc)
+	{
+		KeeperCacheAlloc = KeeperCacheAlloc ? KeeperCacheAlloc * 2 : 64;
+#pragma warning(disable:6308)
+		KeeperCache = (KeeperEntry_t*)realloc(KeeperCache, KeeperCacheAlloc * sizeof(KeeperEntry_t));
+		if (KeeperCache == NULL)
 		{
-			ClearProgressInd();
-			wprintf(L"    Deleted duplicate.\n");
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
 		}
-		return EDR_DELETE;
 	}
+	Entry = &KeeperCache[KeeperCacheCount];
+	KeeperCacheCount += 1;
+	Entry->FileName = FileName;
+	Entry->Data = Data;
+	Entry->Size = FileSize;
+	Entry->LastUse = KeeperCacheTick;
+	KeeperCacheBytes += FileSize;
+	return Data;
 }
 
 //--------------------------------------------------------------------------
-// Check for duplicates.
+// Compare a candidate against the cached contents of its keeper, reading
+// only the candidate from disk.  Returns false if the keeper could not be
+// cached or the candidate could not be read; the caller falls back to the
+// normal two-sided compare.
 //--------------------------------------------------------------------------
-static void CheckDuplicate(FileData_t ThisFile)
+static bool CompareAgainstCachedKeeper(FileData_t* ThisFile, FileData_t* DupeOf, bool* Match)
 {
-	size_t Ptr = 1, * Link = NULL;
-	// Find where in the trie structure it belongs.
+	static BYTE* ReadBuf; // Runs under the index lock; one buffer suffices.
+	BYTE* KeeperData;
+	FILE* File = NULL;
+	ULONGLONG Offset = 0;
+
+	KeeperData = KeeperCacheGet(DupeOf->FileName, DupeOf->FileSize);
+	if (KeeperData == NULL)
+		return false;
+
+	if (ReadBuf == NULL)
+	{
+		ReadBuf = (BYTE*)malloc(CHUNK_SIZE * 16);
+		if (ReadBuf == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	_wfopen_s(&File, ThisFile->FileName, L"rb");
+	if (File == NULL)
+		return false;
+
+	*Match = true;
+	while (Offset < ThisFile->FileSize)
+	{
+		size_t BytesToRead = CHUNK_SIZE * 16;
+		if (ThisFile->FileSize - Offset < BytesToRead)
+			BytesToRead = (size_t)(ThisFile->FileSize - Offset);
+		if (fread(ReadBuf, 1, BytesToRead, File) != BytesToRead)
+		{
+			fclose(File);
+			return false;
+		}
+		ScanStats.CompareBytes += BytesToRead;
+		if (memcmp(ReadBuf, KeeperData + Offset, BytesToRead))
+		{
+			*Match = false;
+			break;
+		}
+		Offset += BytesToRead;
+	}
+	fclose(File);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+// Compute the full-file SHA-256 of a record if it does not have one yet
+// (-fullhash mode).  Each file is read exactly once, no matter how many
+// candidates are later compared against it.
+//--------------------------------------------------------------------------
+static bool EnsureFullHash(FileData_t* File)
+{
+	static BCRYPT_ALG_HANDLE HashAlg;   // Opened once; runs under the index lock.
+	static BYTE* HashBuffer;
+	BCRYPT_HASH_HANDLE Hash = NULL;
+	HANDLE FileHandle = INVALID_HANDLE_VALUE;
+	ULONGLONG BytesLeft;
+	BYTE Digest[FULL_HASH_SIZE];
+	bool Ok = false;
+
+	if (File->FullHash)
+		return true;
+
+	if (HashAlg == NULL)
+	{
+		if (BCryptOpenAlgorithmProvider(&HashAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0) != 0)
+		{
+			fwprintf(stderr, L"Could not open SHA-256 provider.\n");
+			exit(EXIT_FAILURE);
+		}
+		HashBuffer = (BYTE*)malloc(CHUNK_SIZE * 16);
+		if (HashBuffer == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	FileHandle = CreateFileW(File->FileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (FileHandle == INVALID_HANDLE_VALUE)
+		goto out;
+	if (BCryptCreateHash(HashAlg, &Hash, NULL, 0, NULL, 0, 0) != 0)
+		goto out;
+
+	BytesLeft = File->FileSize;
+	while (BytesLeft)
+	{
+		DWORD BytesToRead = CHUNK_SIZE * 16, BytesRead = 0;
+		if (BytesLeft < BytesToRead)
+			BytesToRead = (DWORD)BytesLeft;
+		if (!ReadFile(FileHandle, HashBuffer, BytesToRead, &BytesRead, NULL) || BytesRead == 0)
+			goto out;
+		if (BCryptHashData(Hash, HashBuffer, BytesRead, 0) != 0)
+			goto out;
+		BytesLeft -= BytesRead;
+	}
+	if (BCryptFinishHash(Hash, Digest, FULL_HASH_SIZE, 0) != 0)
+		goto out;
+	File->FullHash = (BYTE*)malloc(FULL_HASH_SIZE);
+	if (File->FullHash == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(File->FullHash, Digest, FULL_HASH_SIZE);
+	ScanStats.FullHashFiles += 1;
+	ScanStats.FullHashBytes += File->FileSize;
+	Ok = true;
+
+out:
+	if (Hash)
+		BCryptDestroyHash(Hash);
+	if (FileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(FileHandle);
+	if (!Ok)
+	{
+		ClearProgressInd();
+		fwprintf(stderr, L"Error doing full file hash on '%s'\n", File->FileName);
+	}
+	return Ok;
+}
+
+//--------------------------------------------------------------------------
+// Eliminate duplicates.
+//--------------------------------------------------------------------------
+static enum EDRes EliminateDuplicate(FileData_t* ThisFile, FileData_t* DupeOf)
+{
+	// First compare whole file.  If mismatch, return 0.
+	bool IsDuplicate = true;
+	bool Hardlinked = false;
+	bool IsReadonly = false;
+
+	if (ThisFile->FileSize != DupeOf->FileSize)
+		return EDR_NOT_DUPE;
+
+	if (DupeOf->NumLinks > 0 && memcmp(&ThisFile->FileIndex, &DupeOf->FileIndex, sizeof(DupeOf->FileIndex)) == 0)
+	{
+		Hardlinked = true;
+		goto dont_read;
+	}
+
+	ScanStats.ComparePairs += 1;
+
+	if (FullHashMode)
+	{
+		// Hash equality stands in for the pairwise compare, so the keeper is
+		// not re-read for the second through Nth candidate in its chain.
+		if (!EnsureFullHash(DupeOf) || !EnsureFullHash(ThisFile))
+			return EDR_NOT_DUPE;
+		IsDuplicate = memcmp(ThisFile->FullHash, DupeOf->FullHash, FULL_HASH_SIZE) == 0;
+	}
+	else if (KeeperCacheBudget != 0 && ThisFile->FileSize <= KeeperCacheBudget
+		&& CompareAgainstCachedKeeper(ThisFile, DupeOf, &IsDuplicate))
+	{
+		// Keeper contents came from the -cachemem cache, so only the
+		// candidate side was read from disk.
+	}
+	else if (ThisFile->FileSize >= NOBUF_COMPARE_THRESHOLD
+		&& CompareFilesUnbuffered(ThisFile->FileName, DupeOf->FileName, ThisFile->FileSize, &IsDuplicate))
+	{
+		// Huge pair compared past the page cache; nothing useful evicted.
+	}
+	else if (!CompareFilesMapped(ThisFile->FileName, DupeOf->FileName, ThisFile->FileSize, &IsDuplicate))
+	{
+		// Mapping failed (exotic file system, address space).  Fall back to
+		// buffered reads through a compare buffer that persists across calls;
+		// EliminateDuplicate runs under the index lock so one buffer suffices.
+		static BYTE* CompareBuf = NULL;
+
+		FILE* File1 = NULL, * File2 = NULL;
+		_wfopen_s(&File1, ThisFile->FileName, L"rb");
+		if (File1 == NULL)
+		{
+			fwprintf(stderr, L"Open file %s failure.\n", ThisFile->FileName);
+			exit(EXIT_FAILURE);
+		}
+		_wfopen_s(&File2, DupeOf->FileName, L"rb");
+		if (File2 == NULL)
+		{
+			fclose(File1);
+			fwprintf(stderr, L"Open file %s failure.\n", DupeOf->FileName);
+			exit(EXIT_FAILURE);
+		}
+
+		size_t BytesLeft = ThisFile->FileSize, BytesToRead = 0;
+		if (CompareBuf == NULL)
+		{
+			CompareBuf = (BYTE*)malloc(CHUNK_SIZE * 2);
+			if (CompareBuf == NULL)
+			{
+				fwprintf(stderr, L"Malloc failure.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		BYTE* Buf1 = CompareBuf;
+		BYTE* Buf2 = CompareBuf + CHUNK_SIZE;
+		IsDuplicate = true;
+		while (BytesLeft)
+		{
+			BytesToRead = BytesLeft;
+			if (BytesToRead > CHUNK_SIZE)
+				BytesToRead = CHUNK_SIZE;
+
+			if (fread(Buf1, 1, BytesToRead, File1) != BytesToRead)
+			{
+				ClearProgressInd();
+				fwprintf(stderr, L"Error doing full file read on '%s'\n", ThisFile->FileName);
+			}
+
+			if (fread(Buf2, 1, BytesToRead, File2) != BytesToRead)
+			{
+				ClearProgressInd();
+				fwprintf(stderr, L"Error doing full file read on '%s'\n", DupeOf->FileName);
+			}
+
+			BytesLeft -= BytesToRead;
+			ScanStats.CompareBytes += BytesToRead * 2;
+
+			if (memcmp(Buf1, Buf2, BytesToRead))
+			{
+				IsDuplicate = false;
+				break;
+			}
+		}
+
+		fclose(File1);
+		fclose(File2);
+	}
+
+	if (!IsDuplicate)
+	{
+		// Full file duplicate check failed (CRC collision, or differs only after 32k)
+		return EDR_NOT_DUPE;
+	}
+
+	DupeStats.DuplicateFiles += 1;
+	DupeStats.DuplicateBytes += ThisFile->FileSize;
+
+dont_read:
+	// With -out the pair goes to the report file instead; console output
+	// must not scale with the duplicate count.
+	if (PrintDuplicates && !HardlinkSearchMode && OutFile == NULL)
+	{
+		ClearProgressInd();
+		wprintf(L"Duplicate: '%s'\n", DupeOf->FileName);
+		wprintf(L"With:      '%s'\n", ThisFile->FileName);
+		if (Hardlinked)
+		{
+			// If the files happen to be hardlinked, show that.
+			wprintf(L"    (hardlinked instances of same file)\n");
+		}
+	}
+
+	if (!MakeHardLinks && !DelDuplicates)
+	{
+		return EDR_NO_OP;
+	}
+
+	// Attributes were fetched with the scan handle; no need to stat again.
+	IsReadonly = (ThisFile->Attributes & FILE_ATTRIBUTE_READONLY) ? true : false;
+
+	if (IsReadonly)
+	{
+		// Readonly file.
+		if (!DoReadonly)
+		{
+			ClearProgressInd();
+			wprintf(L"Skipping duplicate readonly file '%s'.\n", ThisFile->FileName);
+			return EDR_SKIP_RO;
+		}
+	}
+
+	if (MakeHardLinks)
+	{
+		if (Hardlinked)
+			return EDR_NO_OP; // Nothign to do.
+
+		if (DupeOf->NumLinks >= 1023)
+		{
+			// Do not link more than 1023 files onto one physical file (windows limit)
+			ClearProgressInd();
+			wprintf(L"Skipping hardlinking '%s' and '%s', number of links of '%s' has reach limit.\n", ThisFile->FileName, DupeOf->FileName, DupeOf->FileName);
+			return EDR_HDLINK_LIMIT;
+		}
+	}
+
+	if (PlanFileName)
+	{
+		// Plan mode: record the action instead of touching anything; -apply
+		// revalidates by size and file id before executing it.
+		PlanAddAction(DupeOf->FileName, ThisFile->FileName, ThisFile->FileSize,
+			ThisFile->FileIndex.High, ThisFile->FileIndex.Low,
+			ThisFile->Attributes, ThisFile->Mtime);
+		if (OutFile == NULL)
+		{
+			ClearProgressInd();
+			wprintf(L"    Added %s action to the plan file.\n", MakeHardLinks ? L"hardlink" : L"delete");
+		}
+		return MakeHardLinks ? EDR_HDLINK : EDR_DELETE;
+	}
+
+	if (BatchFile)
+	{
+		fprintf(BatchFile, "del %s \"%ls\"\n", IsReadonly ? "/F" : "", EscapeBatchName(ThisFile->FileName));
+		if (MakeHardLinks)
+		{
+			fprintf(BatchFile, "fsutil hardlink create \"%ls\" ", EscapeBatchName(ThisFile->FileName));
+			fprintf(BatchFile, "\"%ls\"\n", EscapeBatchName(DupeOf->FileName));
+			if (IsReadonly)
+			{
+				// If original was readonly, restore that attribute
+				fprintf(BatchFile, "attrib +r \"%ls\"\n", EscapeBatchName(ThisFile->FileName));
+			}
+			if (OutFile == NULL)
+			{
+				ClearProgressInd();
+				wprintf(L"    Added hardlink creation command to the batch file.\n");
+			}
+			return EDR_HDLINK;
+		}
+		if (OutFile == NULL)
+		{
+			ClearProgressInd();
+			wprintf(L"    Added delete command to the batch file.\n");
+		}
+		return EDR_DELETE;
+	}
+
+	// Direct mode: hand the delete/link/restore sequence to the background
+	// executor so the syscalls overlap detection instead of serializing
+	// with it.  The names are arena strings and remain valid for the run,
+	// and the executor strips the readonly bit itself before deleting.
+	ActionQueuePush(ThisFile->FileName, DupeOf->FileName, ThisFile->Attributes,
+		ThisFile->Mtime, MakeHardLinks);
+	if (CheckpointFileName && !MakeHardLinks)
+	{
+		// A resumed traversal will not find this file again; the resume
+		// fingerprint has to know that is this run's own doing.
+		CheckpointNoteDeleted(ThisFile->FileName);
+	}
+	if (OutFile == NULL)
+	{
+		ClearProgressInd();
+		wprintf(L"    Queued %s.\n", MakeHardLinks ? L"hardlink creation" : L"delete");
+	}
+	return MakeHardLinks ? EDR_HDLINK : EDR_DELETE;
+}
+
+//--------------------------------------------------------------------------
+// Append one pair to the -out report: action, size, signature, keeper
+// path, duplicate path, tab separated.  Runs under the index lock, so
+// there is a single writer, and the large stdio buffer makes each record
+// a memcpy instead of a console round trip.
+//--------------------------------------------------------------------------
+static void OutFileRecord(const FileData_t* ThisFile, const FileData_t* DupeOf, enum EDRes r)
+{
+	const WCHAR* Action;
+
+	switch (r)
+	{
+	case EDR_HDLINK:
+		Action = BatchFile ? L"batch-hardlink" : PlanFileName ? L"plan-hardlink" : L"hardlink";
+		break;
+	case EDR_DELETE:
+		Action = BatchFile ? L"batch-delete" : PlanFileName ? L"plan-delete" : L"delete";
+		break;
+	case EDR_SKIP_RO:
+		Action = L"skip-readonly";
+		break;
+	case EDR_HDLINK_LIMIT:
+		Action = L"skip-linklimit";
+		break;
+	default:
+		Action = L"dupe";
+		break;
+	}
+	fwprintf(OutFile, L"%s\t%llu\t%08x%08x\t%s\t%s\n",
+		Action, ThisFile->FileSize, ThisFile->Checksum.Crc, ThisFile->Checksum.Sum,
+		DupeOf->FileName, ThisFile->FileName);
+}
+
+//--------------------------------------------------------------------------
+// Hash a checksum for the index.
+//--------------------------------------------------------------------------
+static size_t HashChecksum(const Checksum_t* Checksum)
+{
+	ULONGLONG Key = ((ULONGLONG)Checksum->Crc << 32) | Checksum->Sum;
+	return (size_t)(Key * 0x9E3779B97F4A7C15ull);
+}
+
+//--------------------------------------------------------------------------
+// Grow (or create) the checksum index and rehash the chain heads.
+//--------------------------------------------------------------------------
+static void GrowCkIndex(void)
+{
+	size_t* OldIndex = CkIndex;
+	Checksum_t* OldSums = CkSums;
+	size_t OldSize = CkIndexSize, a, Slot;
+
+	CkIndexSize = CkIndexSize ? CkIndexSize * 2 : 2048;
+	CkIndex = (size_t*)calloc(CkIndexSize, sizeof(size_t));
+	CkSums = (Checksum_t*)calloc(CkIndexSize, sizeof(Checksum_t));
+	if (CkIndex == NULL || CkSums == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (a = 0; a < OldSize; a++)
+	{
+		if (OldIndex[a] == 0)
+			continue;
+		Slot = HashChecksum(&OldSums[a]) & (CkIndexSize - 1);
+		while (CkIndex[Slot])
+			Slot = (Slot + 1) & (CkIndexSize - 1);
+		CkIndex[Slot] = OldIndex[a];
+		CkSums[Slot] = OldSums[a];
+	}
+	free(OldIndex);
+	free(OldSums);
+}
+
+//--------------------------------------------------------------------------
+// Check for duplicates.
+//--------------------------------------------------------------------------
+static void CheckDuplicate(FileData_t ThisFile)
+{
+	size_t Ptr, Slot;
 
 	DupeStats.TotalFiles += 1;
 	DupeStats.TotalBytes += ThisFile.FileSize;
+	ScanStats.IndexLookups += 1;
 
-	if (NumUnique == 1)
-		goto store_it;
+	if (NumUnique * 3 >= CkIndexSize * 2)
+		GrowCkIndex();
 
-	while (true)
+	// Probe the dense index for this checksum.  Mismatching probes only
+	// touch CkSums; FileData is not read until the checksum matches.
+	Slot = HashChecksum(&ThisFile.Checksum) & (CkIndexSize - 1);
+	while (CkIndex[Slot] != 0)
 	{
-		int comp = memcmp(&(ThisFile.Checksum), &(FileData[Ptr].Checksum), sizeof(Checksum_t));
-		if (comp == 0)
+		ScanStats.IndexProbes += 1;
+		if (memcmp(&(ThisFile.Checksum), &CkSums[Slot], sizeof(Checksum_t)) == 0)
 		{
-			// Check for true duplicate.
-			if (!ReferenceFiles && !HardlinkSearchMode)
+			Ptr = CkIndex[Slot];
+			// Check for true duplicate against every chain member.  In
+			// -clusters mode verification is deferred: every member is
+			// appended and the chains are resolved in one pass at the end.
+			if (!ThisFile.IsReference && !HardlinkSearchMode && !ClusterMode)
 			{
-				enum EDRes r = EliminateDuplicate(ThisFile, FileData[Ptr]);
-				switch (r)
-				{
-				case EDR_HDLINK:
-					FileData[Ptr].NumLinks += 1; // Update link count.
-				case EDR_DELETE:
-				case EDR_NO_OP:
-				case EDR_SKIP_RO:
-				case EDR_HDLINK_LIMIT:// Its a duplicate file.  Do not store info on it.
-					return;
-				}
-				if (FileData[Ptr].Same)
-				{
-					Ptr = FileData[Ptr].Same;
-				}
-				else
+				while (true)
 				{
-					FileData[Ptr].Same = NumUnique;
-					break;
+					enum EDRes r = EliminateDuplicate(&ThisFile, &FileData[Ptr]);
+					switch (r)
+					{
+					case EDR_HDLINK:
+						FileData[Ptr].NumLinks += 1; // Update link count.
+					case EDR_DELETE:
+					case EDR_NO_OP:
+					case EDR_SKIP_RO:
+					case EDR_HDLINK_LIMIT:// Its a duplicate file.  Do not store info on it.
+						if (OutFile)
+							OutFileRecord(&ThisFile, &FileData[Ptr], r);
+						free(ThisFile.FullHash); // Record is dropped; its hash block goes too.
+						return;
+					}
+					if (FileData[Ptr].Same)
+					{
+						Ptr = FileData[Ptr].Same;
+					}
+					else
+					{
+						FileData[Ptr].Same = NumUnique;
+						goto store_it;
+					}
 				}
 			}
-			// Build a chain on one side of the branch.
-			// That way, we will check every checksum collision from here on.
+			// Append at the end of the chain.  That way, we will check every
+			// checksum collision from here on.
 			else
 			{
 				while (true)
@@ -430,269 +1452,1945 @@ static void CheckDuplicate(FileData_t ThisFile)
 				}
 			}
 		}
-		else
+		Slot = (Slot + 1) & (CkIndexSize - 1);
+	}
+
+	// Not seen before; this entry becomes a new chain head.
+	CkIndex[Slot] = NumUnique;
+	CkSums[Slot] = ThisFile.Checksum;
+
+store_it:
+
+	if (NumUnique >= NumAllocated)
+	{
+		// Array is full.  Make it bigger
+		NumAllocated = NumAllocated + NumAllocated / 2;
+#pragma warning(disable:6308)
+		FileData = (FileData_t*)realloc(FileData, NumAllocated * sizeof(FileData_t));
+		if (FileData == NULL)
 		{
-			if (comp > 0)
-			{
-				Link = &(FileData[Ptr].Larger);
-			}
-			else
-			{
-				Link = &(FileData[Ptr].Smaller);
-			}
-			if (*Link == 0)
-			{
-				// Link it to here.
-				*Link = NumUnique;
-				break;
-			}
-			else
-			{
-				Ptr = *Link;
-			}
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+#pragma warning(disable:6386)
+	FileData[NumUnique] = ThisFile;
+	NumUnique += 1;
+}
+
+//--------------------------------------------------------------------------
+// Show the hardlink groups a -listlink scan collected.  One linear pass
+// over the dense FileData array, in scan order; a group is printed when
+// its chain head is reached.  Heads are recognized with a single index
+// probe (chains only ever link forward), so the walk needs no recursion,
+// no visited marks and no scratch memory no matter how many entries the
+// scan produced.
+//--------------------------------------------------------------------------
+static void ShowLinkGroups(void)
+{
+	size_t index, Slot;
+
+	for (index = 1; index < NumUnique; index++)
+	{
+		if (FileData[index].NumLinks <= 1)
+			continue;
+
+		// The index slot for this checksum names the chain head; later
+		// members of an already printed group are skipped here.
+		Slot = HashChecksum(&FileData[index].Checksum) & (CkIndexSize - 1);
+		while (CkIndex[Slot] != 0
+			&& memcmp(&FileData[index].Checksum, &CkSums[Slot], sizeof(Checksum_t)) != 0)
+		{
+			Slot = (Slot + 1) & (CkIndexSize - 1);
+		}
+		if (CkIndex[Slot] != index)
+			continue;
+
+		{
+			size_t GroupLen = 0, Ptr = index;
+			wprintf(L"\nHardlink group %llu\n", DupeStats.HardlinkGroups);
+			while (Ptr)
+			{
+				wprintf(L"  \"%s\"\n", FileData[Ptr].FileName);
+				GroupLen += 1;
+				Ptr = FileData[Ptr].Same;
+			}
+			wprintf(L"Hardlink group, %llu of %lu hardlinked instances found in search tree:\n", GroupLen, FileData[index].NumLinks);
+			DupeStats.HardlinkGroups += 1;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------
+// Duplicate cluster report (-clusters).  The scan deferred all
+// verification, so a checksum chain may mix hardlinked instances,
+// different sizes and outright collisions.  Each chain is resolved here
+// with one multi-way pass per size partition: every distinct physical
+// file is read at most once, in CHUNK_SIZE blocks, and groups split at
+// the first block where members differ.  Runs too wide for that (more
+// open handles and chunk buffers than CLUSTER_MAX_WAYS allows) and runs
+// under -fullhash group by the full-file hash instead, which needs one
+// handle and no shared buffers no matter how wide the run is.  Verified
+// clusters are then printed largest reclaimable size first.
+//--------------------------------------------------------------------------
+#define CLUSTER_LINK_FLAG ((size_t)1 << 63) // Marks a hardlinked instance in the name list.
+#define CLUSTER_MAX_WAYS 512 // Bounds simultaneous handles and chunk buffers (32 MB) per run.
+
+typedef struct
+{
+	size_t NameOff;   // Offset into the shared name index array.
+	size_t NumNames;  // Paths listed, including hardlinked instances.
+	ULONGLONG Wasted; // (distinct physical copies - 1) * file size.
+} Cluster_t;
+
+static size_t* ClusterNames; // FileData indices, cluster after cluster.
+static size_t NumClusterNames, ClusterNamesAlloc;
+static Cluster_t* Clusters;
+static size_t NumClusters, ClustersAlloc;
+
+static int CompareMemberSize(const void* p1, const void* p2)
+{
+	size_t m1 = *(const size_t*)p1, m2 = *(const size_t*)p2;
+	if (FileData[m1].FileSize != FileData[m2].FileSize)
+		return FileData[m1].FileSize > FileData[m2].FileSize ? -1 : 1;
+	return m1 < m2 ? -1 : 1; // Indices are distinct; keep scan order inside a size.
+}
+
+static int CompareClusterWasted(const void* p1, const void* p2)
+{
+	const Cluster_t* c1 = (const Cluster_t*)p1;
+	const Cluster_t* c2 = (const Cluster_t*)p2;
+	if (c1->Wasted != c2->Wasted)
+		return c1->Wasted > c2->Wasted ? -1 : 1;
+	return c1->NameOff < c2->NameOff ? -1 : 1; // Scan order between equal groups.
+}
+
+//--------------------------------------------------------------------------
+// Record one verified group (Members[a] with Group[a] == g) as a
+// cluster, unless it has nothing reclaimable.
+//--------------------------------------------------------------------------
+static void ClusterEmit(const size_t* Members, const int* Group, const size_t* Twin,
+	size_t n, int g, ULONGLONG FileSize)
+{
+	size_t a, NameOff = NumClusterNames, NumNames = 0, NumPhysical = 0;
+
+	for (a = 0; a < n; a++)
+	{
+		if (Group[a] != g)
+			continue;
+		if (NumClusterNames >= ClusterNamesAlloc)
+		{
+			ClusterNamesAlloc = ClusterNamesAlloc + 1024 + ClusterNamesAlloc / 2;
+#pragma warning(disable:6308)
+			ClusterNames = (size_t*)realloc(ClusterNames, ClusterNamesAlloc * sizeof(size_t));
+			if (ClusterNames == NULL)
+			{
+				fwprintf(stderr, L"Malloc failure.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		ClusterNames[NumClusterNames] = Members[a];
+		if (Twin[a] != SIZE_MAX)
+			ClusterNames[NumClusterNames] |= CLUSTER_LINK_FLAG;
+		else
+			NumPhysical += 1;
+		NumClusterNames += 1;
+		NumNames += 1;
+	}
+
+	if (NumPhysical < 2)
+	{
+		NumClusterNames = NameOff; // Nothing reclaimable; drop the names again.
+		return;
+	}
+
+	if (NumClusters >= ClustersAlloc)
+	{
+		ClustersAlloc = ClustersAlloc + 256 + ClustersAlloc / 2;
+#pragma warning(disable:6308)
+		Clusters = (Cluster_t*)realloc(Clusters, ClustersAlloc * sizeof(Cluster_t));
+		if (Clusters == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	Clusters[NumClusters].NameOff = NameOff;
+	Clusters[NumClusters].NumNames = NumNames;
+	Clusters[NumClusters].Wasted = (NumPhysical - 1) * FileSize;
+	DupeStats.DuplicateFiles += NumPhysical - 1;
+	DupeStats.DuplicateBytes += Clusters[NumClusters].Wasted;
+	NumClusters += 1;
+}
+
+//--------------------------------------------------------------------------
+// Verify one run of checksum-equal, size-equal chain members with a
+// single multi-way pass and record the resulting content clusters.
+//--------------------------------------------------------------------------
+static void ClusterResolveRun(const size_t* Members, size_t n)
+{
+	ULONGLONG FileSize = FileData[Members[0]].FileSize;
+	int* Group, * OldGroup;
+	size_t* Twin, * Leaders, * Counts, * BufOf;
+	HANDLE* Handles;
+	BYTE* Bufs = NULL;
+	int NumGroups = 1;
+	int g;
+	size_t a, b, NumPhysical = 0;
+	ULONGLONG Offset;
+
+	Group = (int*)malloc(n * sizeof(int));
+	OldGroup = (int*)malloc(n * sizeof(int));
+	Twin = (size_t*)malloc(n * sizeof(size_t));
+	Leaders = (size_t*)malloc(n * sizeof(size_t));
+	Counts = (size_t*)malloc(n * sizeof(size_t));
+	BufOf = (size_t*)malloc(n * sizeof(size_t));
+	Handles = (HANDLE*)malloc(n * sizeof(HANDLE));
+	if (Group == NULL || OldGroup == NULL || Twin == NULL || Leaders == NULL || Counts == NULL || BufOf == NULL || Handles == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Hardlinked instances attach to their first physical twin and are not
+	// read.  Only members that actually have extra links are probed, so
+	// the quadratic walk is over the (rare) multi-linked members only.
+	for (a = 0; a < n; a++)
+	{
+		Group[a] = 0;
+		Twin[a] = SIZE_MAX;
+		Handles[a] = INVALID_HANDLE_VALUE;
+		if (FileData[Members[a]].NumLinks > 1)
+		{
+			for (b = 0; b < a; b++)
+			{
+				if (Twin[b] == SIZE_MAX && FileData[Members[b]].NumLinks > 1
+					&& memcmp(&FileData[Members[a]].FileIndex, &FileData[Members[b]].FileIndex,
+						sizeof(FileData[Members[a]].FileIndex)) == 0)
+				{
+					Twin[a] = b;
+					break;
+				}
+			}
+		}
+		if (Twin[a] == SIZE_MAX)
+		{
+			BufOf[a] = NumPhysical; // Chunk buffer slot; only physical members read.
+			NumPhysical += 1;
+		}
+	}
+
+	if (FullHashMode || NumPhysical > CLUSTER_MAX_WAYS)
+	{
+		// Hash every physical member (each file read once by EnsureFullHash)
+		// and split the run by hash in a single refinement round.  Runs too
+		// wide for the multi-way compare below take this path too: it holds
+		// one handle and one buffer however many members there are.
+		size_t NumLeaders = 0;
+		for (a = 0; a < n; a++)
+		{
+			if (Twin[a] != SIZE_MAX)
+				continue;
+			if (!EnsureFullHash(&FileData[Members[a]]))
+			{
+				Group[a] = -1;
+				continue;
+			}
+			for (b = 0; b < NumLeaders; b++)
+			{
+				if (memcmp(FileData[Members[a]].FullHash, FileData[Members[Leaders[b]]].FullHash, FULL_HASH_SIZE) == 0)
+				{
+					Group[a] = Group[Leaders[b]];
+					break;
+				}
+			}
+			if (b == NumLeaders)
+			{
+				Group[a] = NumLeaders == 0 ? 0 : NumGroups++;
+				Leaders[NumLeaders++] = a;
+			}
+		}
+	}
+	else
+	{
+		Bufs = (BYTE*)malloc(NumPhysical * CHUNK_SIZE);
+		if (Bufs == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// Win32 handles, not stdio streams: the CRT caps open streams at
+		// 512, which a wide run would hit.
+		for (a = 0; a < n; a++)
+		{
+			if (Twin[a] != SIZE_MAX)
+				continue;
+			Handles[a] = CreateFileW(FileData[Members[a]].FileName, GENERIC_READ, FILE_SHARE_READ,
+				NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (Handles[a] == INVALID_HANDLE_VALUE)
+			{
+				if (!HideCantReadMessage)
+				{
+					ClearProgressInd();
+					fwprintf(stderr, L"Could not read '%s'; excluded from its cluster.\n", FileData[Members[a]].FileName);
+				}
+				Group[a] = -1;
+			}
+		}
+
+		for (Offset = 0; Offset < FileSize; Offset += CHUNK_SIZE)
+		{
+			size_t Chunk = FileSize - Offset > CHUNK_SIZE ? CHUNK_SIZE : (size_t)(FileSize - Offset);
+			int RoundGroups = NumGroups;
+			bool AnyShared = false;
+
+			// Once every group is down to one member the rest of the run
+			// can never split further; stop reading.
+			for (g = 0; g < NumGroups; g++)
+				Counts[g] = 0;
+			for (a = 0; a < n; a++)
+			{
+				if (Twin[a] == SIZE_MAX && Group[a] >= 0 && ++Counts[Group[a]] > 1)
+					AnyShared = true;
+			}
+			if (!AnyShared)
+				break;
+
+			for (a = 0; a < n; a++)
+			{
+				DWORD Got = 0;
+				if (Handles[a] == INVALID_HANDLE_VALUE || Group[a] < 0)
+					continue;
+				if (!ReadFile(Handles[a], Bufs + BufOf[a] * CHUNK_SIZE, (DWORD)Chunk, &Got, NULL) || Got != Chunk)
+				{
+					ClearProgressInd();
+					fwprintf(stderr, L"Error doing full file read on '%s'\n", FileData[Members[a]].FileName);
+					Group[a] = -1;
+					continue;
+				}
+				ScanStats.CompareBytes += Chunk;
+			}
+
+			// Refine: within each group the first member stays put and
+			// becomes a leader; the rest join the first leader whose block
+			// matches, or found a new group.
+			memcpy(OldGroup, Group, n * sizeof(int));
+			for (g = 0; g < RoundGroups; g++)
+			{
+				size_t NumLeaders = 0;
+				for (a = 0; a < n; a++)
+				{
+					if (OldGroup[a] != g || Twin[a] != SIZE_MAX || Group[a] < 0)
+						continue;
+					for (b = 0; b < NumLeaders; b++)
+					{
+						if (memcmp(Bufs + BufOf[a] * CHUNK_SIZE, Bufs + BufOf[Leaders[b]] * CHUNK_SIZE, Chunk) == 0)
+						{
+							Group[a] = Group[Leaders[b]];
+							break;
+						}
+					}
+					if (b == NumLeaders)
+					{
+						if (NumLeaders != 0)
+							Group[a] = NumGroups++;
+						Leaders[NumLeaders++] = a;
+					}
+				}
+			}
+		}
+
+		for (a = 0; a < n; a++)
+		{
+			if (Handles[a] != INVALID_HANDLE_VALUE)
+				CloseHandle(Handles[a]);
+		}
+	}
+
+	// Hardlinked instances always match their twin's content.
+	for (a = 0; a < n; a++)
+	{
+		if (Twin[a] != SIZE_MAX)
+			Group[a] = Group[Twin[a]];
+	}
+
+	for (g = 0; g < NumGroups; g++)
+		ClusterEmit(Members, Group, Twin, n, g, FileSize);
+
+	free(Group);
+	free(OldGroup);
+	free(Twin);
+	free(Leaders);
+	free(Counts);
+	free(BufOf);
+	free(Handles);
+	free(Bufs);
+}
+
+//--------------------------------------------------------------------------
+// Resolve every chain the -clusters scan collected and print the report.
+// Chain heads are found the same way ShowLinkGroups finds them: one
+// linear pass with a single index probe per candidate.
+//--------------------------------------------------------------------------
+static void ShowClusters(void)
+{
+	size_t index, Slot, a;
+	size_t* Members = NULL;
+	size_t NumMembers, MembersAlloc = 0;
+	ULONGLONG TotalWasted = 0;
+
+	for (index = 1; index < NumUnique; index++)
+	{
+		if (FileData[index].Same == 0)
+			continue; // Singleton, or the last member of a chain.
+
+		Slot = HashChecksum(&FileData[index].Checksum) & (CkIndexSize - 1);
+		while (CkIndex[Slot] != 0
+			&& memcmp(&FileData[index].Checksum, &CkSums[Slot], sizeof(Checksum_t)) != 0)
+		{
+			Slot = (Slot + 1) & (CkIndexSize - 1);
+		}
+		if (CkIndex[Slot] != index)
+			continue;
+
+		NumMembers = 0;
+		for (a = index; a != 0; a = FileData[a].Same)
+		{
+			if (NumMembers >= MembersAlloc)
+			{
+				MembersAlloc = MembersAlloc + 256 + MembersAlloc / 2;
+#pragma warning(disable:6308)
+				Members = (size_t*)realloc(Members, MembersAlloc * sizeof(size_t));
+				if (Members == NULL)
+				{
+					fwprintf(stderr, L"Malloc failure.\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			Members[NumMembers++] = a;
+		}
+
+		// A chain only guarantees equal checksums; partition by size and
+		// verify each partition of two or more on its own.
+		qsort(Members, NumMembers, sizeof(size_t), CompareMemberSize);
+		for (a = 0; a < NumMembers; )
+		{
+			size_t RunEnd = a + 1;
+			while (RunEnd < NumMembers && FileData[Members[RunEnd]].FileSize == FileData[Members[a]].FileSize)
+				RunEnd += 1;
+			if (RunEnd - a >= 2)
+				ClusterResolveRun(Members + a, RunEnd - a);
+			a = RunEnd;
+		}
+	}
+	free(Members);
+
+	qsort(Clusters, NumClusters, sizeof(Cluster_t), CompareClusterWasted);
+
+	ClearProgressInd();
+	for (a = 0; a < NumClusters; a++)
+	{
+		Cluster_t* Cluster = &Clusters[a];
+		size_t b;
+		TotalWasted += Cluster->Wasted;
+		wprintf(L"\nCluster %llu: %llu files, %llu kBytes reclaimable\n",
+			(ULONGLONG)(a + 1), (ULONGLONG)Cluster->NumNames, Cluster->Wasted / 1000);
+		for (b = 0; b < Cluster->NumNames; b++)
+		{
+			size_t Entry = ClusterNames[Cluster->NameOff + b];
+			wprintf(L"  \"%s\"%s\n", FileData[Entry & ~CLUSTER_LINK_FLAG].FileName,
+				(Entry & CLUSTER_LINK_FLAG) ? L" (hardlinked instance)" : L"");
+		}
+	}
+	wprintf(L"\nDuplicate clusters: %llu, %llu kBytes reclaimable in total.\n",
+		(ULONGLONG)NumClusters, TotalWasted / 1000);
+}
+
+//--------------------------------------------------------------------------
+// Do selected operations to one file at a time.
+//--------------------------------------------------------------------------
+// One in-flight signature read.  StartSignatureRead opens the file and
+// issues the sample reads overlapped; FinishSignatureRead completes them
+// and merges the file into the duplicate index.  Each worker keeps a small
+// pipeline of these so reads queue up on the device instead of running
+// at queue depth one.
+//
+// Small files are sampled with a single 32k head read as always.  Files
+// of SIG_SAMPLE_THRESHOLD or larger also fold a middle and a tail block
+// into the signature, since large files with identical headers (VM
+// images, database dumps) would otherwise all collide on the head block
+// and force full compares that fail megabytes in.
+typedef struct
+{
+	PendingFile_t* Pending;
+	HANDLE FileHandle;
+	OVERLAPPED Overlapped[3];
+	FileData_t ThisFile;
+	DWORD BytesToRead[3];
+	int NumReads;
+	bool ReadPending; // Reads were issued and must be completed.
+	bool Failed;      // File could not be processed; nothing to merge.
+	BYTE Buffer[3][BYTES_DO_CHECKSUM_OF];
+} SigRead_t;
+
+#define SIG_PIPELINE_DEPTH 16
+#define SIG_SAMPLE_THRESHOLD (1 << 20) // Sample middle and tail above this size.
+
+// Signatures of hardlinked files, keyed by NTFS file id.  Trees that use
+// hardlinks heavily (typically from previous finddupe runs) present the
+// same physical file under many paths; the first path computes the
+// signature and every later path inherits it here with no I/O.  Only
+// consulted for files with more than one link.
+static ULONGLONG* LinkSigKeys; // NTFS file id; 0 marks an empty slot (no real file has id 0).
+static Checksum_t* LinkSigVals;
+static size_t LinkSigSize, LinkSigUsed;
+static CRITICAL_SECTION LinkSigLock;
+
+//--------------------------------------------------------------------------
+// Look up the stored signature of a physical file by its NTFS file id.
+//--------------------------------------------------------------------------
+static bool LinkSigLookup(DWORD IndexHigh, DWORD IndexLow, Checksum_t* Checksum)
+{
+	ULONGLONG Key = ((ULONGLONG)IndexHigh << 32) | IndexLow;
+	size_t Slot;
+	bool Found = false;
+
+	EnterCriticalSection(&LinkSigLock);
+	if (LinkSigSize)
+	{
+		Slot = (size_t)((Key * 0x9E3779B97F4A7C15ull) & (LinkSigSize - 1));
+		while (LinkSigKeys[Slot])
+		{
+			if (LinkSigKeys[Slot] == Key)
+			{
+				*Checksum = LinkSigVals[Slot];
+				Found = true;
+				break;
+			}
+			Slot = (Slot + 1) & (LinkSigSize - 1);
+		}
+	}
+	LeaveCriticalSection(&LinkSigLock);
+	return Found;
+}
+
+//--------------------------------------------------------------------------
+// Record the signature of a physical file under its NTFS file id.  Does
+// nothing if the id is already present.
+//--------------------------------------------------------------------------
+static void LinkSigStore(DWORD IndexHigh, DWORD IndexLow, const Checksum_t* Checksum)
+{
+	ULONGLONG Key = ((ULONGLONG)IndexHigh << 32) | IndexLow;
+	size_t Slot;
+
+	if (Key == 0)
+		return;
+
+	EnterCriticalSection(&LinkSigLock);
+	if (LinkSigUsed * 3 >= LinkSigSize * 2)
+	{
+		// Grow (or create) the table and rehash.
+		ULONGLONG* OldKeys = LinkSigKeys;
+		Checksum_t* OldVals = LinkSigVals;
+		size_t OldSize = LinkSigSize, a;
+		LinkSigSize = LinkSigSize ? LinkSigSize * 2 : 4096;
+		LinkSigKeys = (ULONGLONG*)calloc(LinkSigSize, sizeof(ULONGLONG));
+		LinkSigVals = (Checksum_t*)calloc(LinkSigSize, sizeof(Checksum_t));
+		if (LinkSigKeys == NULL || LinkSigVals == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		for (a = 0; a < OldSize; a++)
+		{
+			if (OldKeys[a] == 0)
+				continue;
+			Slot = (size_t)((OldKeys[a] * 0x9E3779B97F4A7C15ull) & (LinkSigSize - 1));
+			while (LinkSigKeys[Slot])
+				Slot = (Slot + 1) & (LinkSigSize - 1);
+			LinkSigKeys[Slot] = OldKeys[a];
+			LinkSigVals[Slot] = OldVals[a];
+		}
+		free(OldKeys);
+		free(OldVals);
+	}
+
+	Slot = (size_t)((Key * 0x9E3779B97F4A7C15ull) & (LinkSigSize - 1));
+	while (LinkSigKeys[Slot] && LinkSigKeys[Slot] != Key)
+		Slot = (Slot + 1) & (LinkSigSize - 1);
+	if (LinkSigKeys[Slot] == 0)
+	{
+		LinkSigKeys[Slot] = Key;
+		LinkSigVals[Slot] = *Checksum;
+		LinkSigUsed += 1;
+	}
+	LeaveCriticalSection(&LinkSigLock);
+}
+
+static void StartSignatureRead(SigRead_t* Slot, PendingFile_t* Pending)
+{
+	const WCHAR* FileName = Pending->FileName;
+	ULONGLONG FileSize = Pending->FileSize;
+	BY_HANDLE_FILE_INFORMATION FileInfo;
+	FileData_t* ThisFile = &Slot->ThisFile;
+
+	Slot->Pending = Pending;
+	Slot->FileHandle = INVALID_HANDLE_VALUE;
+	Slot->ReadPending = false;
+	Slot->Failed = false;
+	memset(ThisFile, 0, sizeof(*ThisFile));
+	ThisFile->FileSize = FileSize;
+	ThisFile->IsReference = Pending->IsReference;
+
+	// One handle serves metadata and the signature read.
+	Slot->FileHandle = CreateFileW(FileName,
+		GENERIC_READ,              // dwDesiredAccess
+		FILE_SHARE_READ,           // dwShareMode
+		NULL,                      // Security attirbutes
+		OPEN_EXISTING,             // dwCreationDisposition
+		FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, // dwFlagsAndAttributes
+		NULL);                     // hTemplateFile.  Ignored for existing.
+	if (Slot->FileHandle == INVALID_HANDLE_VALUE)
+	{
+	cant_read_file:
+		Slot->Failed = true;
+		InterlockedIncrement64((volatile LONGLONG*)&DupeStats.CantReadFiles);
+		if (!HideCantReadMessage)
+		{
+			ClearProgressInd();
+			fwprintf(stderr, L"Could not read '%s'.\n", FileName);
+		}
+		return;
+	}
+
+	if (!GetFileInformationByHandle(Slot->FileHandle, &FileInfo))
+	{
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		goto cant_read_file;
+	}
+
+	if (Verbose)
+	{
+		ClearProgressInd();
+		wprintf(L"Hardlinked (%lu links) node=%08lx %08lx: %s\n", FileInfo.nNumberOfLinks, FileInfo.nFileIndexHigh, FileInfo.nFileIndexLow, FileName);
+	}
+
+	if (HardlinkSearchMode && FileInfo.nNumberOfLinks == 1)
+	{
+		// File has only one link, so its not hardlinked.  Skip for hardlink search mode.
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		Slot->Failed = true;
+		return;
+	}
+
+	// Use the file index (which is NTFS equivalent of the iNode) instead of the CRC.
+	ThisFile->FileIndex.Low = FileInfo.nFileIndexLow;
+	ThisFile->FileIndex.High = FileInfo.nFileIndexHigh;
+	ThisFile->NumLinks = FileInfo.nNumberOfLinks;
+	ThisFile->Attributes = FileInfo.dwFileAttributes;
+	ThisFile->Mtime = Pending->Mtime;
+
+	if (HardlinkSearchMode)
+	{
+		// For hardlink search mode, duplicates are detected by file index, not CRC,
+		// so copy the file ID into the CRC.
+		ThisFile->Checksum.Sum = ThisFile->FileIndex.Low;
+		ThisFile->Checksum.Crc = ThisFile->FileIndex.High;
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		return;
+	}
+
+	if (FileInfo.nNumberOfLinks > 1
+		&& LinkSigLookup(ThisFile->FileIndex.High, ThisFile->FileIndex.Low, &ThisFile->Checksum))
+	{
+		// Another path to the same physical file was already checksummed;
+		// inherit its signature with no additional I/O.
+		if (ShowStats)
+			InterlockedIncrement64(&ScanStats.LinkSigHits);
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		return;
+	}
+
+	if (SigCacheFileName
+		&& SigCacheLookup(FileName, FileSize, Pending->Mtime,
+			ThisFile->FileIndex.High, ThisFile->FileIndex.Low,
+			&ThisFile->Checksum.Crc, &ThisFile->Checksum.Sum))
+	{
+		// Unchanged since the last run; signature comes from the cache
+		// and the 32k read is skipped entirely.
+		if (ShowStats)
+			InterlockedIncrement64(&ScanStats.SigCacheHits);
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		return;
+	}
+
+	Slot->BytesToRead[0] = FileSize > BYTES_DO_CHECKSUM_OF ? BYTES_DO_CHECKSUM_OF : (DWORD)FileSize;
+	Slot->NumReads = 1;
+	if (Slot->BytesToRead[0] == 0)
+	{
+		// Zero length file (-z); the empty signature plus size term is final.
+		ThisFile->Checksum.Sum += (unsigned int)FileSize;
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		return;
+	}
+
+	// Issue the reads; completion is picked up in FinishSignatureRead so
+	// more reads can be started while these are in flight.
+	{
+		ULONGLONG Offsets[3];
+		int r;
+
+		Offsets[0] = 0;
+		// Sampling follows the selected kernel, not just -legacysigs: the
+		// persisted formats record only which kernel was used, so the
+		// kernel must fully determine the signature definition.  A CPU
+		// without SSE4.2 therefore computes plain legacy signatures.
+		if (FileSize >= SIG_SAMPLE_THRESHOLD && CalcSignature == CalcCrcHw)
+		{
+			// Middle block aligned down to a 32k boundary, plus the last 32k.
+			// At the 1 MB threshold the three blocks can never overlap.
+			Offsets[1] = (FileSize / 2) & ~(ULONGLONG)(BYTES_DO_CHECKSUM_OF - 1);
+			Offsets[2] = FileSize - BYTES_DO_CHECKSUM_OF;
+			Slot->BytesToRead[1] = BYTES_DO_CHECKSUM_OF;
+			Slot->BytesToRead[2] = BYTES_DO_CHECKSUM_OF;
+			Slot->NumReads = 3;
+		}
+
+		for (r = 0; r < Slot->NumReads; r++)
+		{
+			HANDLE Event = Slot->Overlapped[r].hEvent; // Events are owned by the slot.
+			memset(&Slot->Overlapped[r], 0, sizeof(OVERLAPPED));
+			Slot->Overlapped[r].hEvent = Event;
+			Slot->Overlapped[r].Offset = (DWORD)Offsets[r];
+			Slot->Overlapped[r].OffsetHigh = (DWORD)(Offsets[r] >> 32);
+			if (!ReadFile(Slot->FileHandle, Slot->Buffer[r], Slot->BytesToRead[r], NULL, &Slot->Overlapped[r])
+				&& GetLastError() != ERROR_IO_PENDING)
+			{
+				// Let any reads already on the device finish before
+				// closing the handle out from under them.
+				DWORD Dummy;
+				int q;
+				for (q = 0; q < r; q++)
+					GetOverlappedResult(Slot->FileHandle, &Slot->Overlapped[q], &Dummy, TRUE);
+				CloseHandle(Slot->FileHandle);
+				Slot->FileHandle = INVALID_HANDLE_VALUE;
+				goto cant_read_file;
+			}
+		}
+	}
+	Slot->ReadPending = true;
+}
+
+static void FinishSignatureRead(SigRead_t* Slot)
+{
+	PendingFile_t* Pending = Slot->Pending;
+	FileData_t* ThisFile = &Slot->ThisFile;
+
+	if (Slot->Failed)
+		return;
+
+	if (Slot->ReadPending)
+	{
+		int r;
+		bool ReadOk = true;
+		DWORD TotalRead = 0;
+
+		// Complete in issue order so samples fold into the checksum in a
+		// fixed head, middle, tail sequence.
+		for (r = 0; r < Slot->NumReads; r++)
+		{
+			DWORD BytesRead = 0;
+			if (!GetOverlappedResult(Slot->FileHandle, &Slot->Overlapped[r], &BytesRead, TRUE)
+				|| BytesRead != Slot->BytesToRead[r])
+			{
+				ReadOk = false;
+				continue; // Still drain the remaining reads.
+			}
+			TotalRead += BytesRead;
+			if (ReadOk)
+				CalcSignature(&ThisFile->Checksum, Slot->Buffer[r], BytesRead);
+		}
+		CloseHandle(Slot->FileHandle);
+		Slot->FileHandle = INVALID_HANDLE_VALUE;
+		if (!ReadOk)
+		{
+			if (!HideCantReadMessage)
+			{
+				ClearProgressInd();
+				fwprintf(stderr, L"File read problem on '%s'.\n", Pending->FileName);
+			}
+			InterlockedIncrement64((volatile LONGLONG*)&DupeStats.CantReadFiles);
+			return;
+		}
+		if (ShowStats)
+		{
+			InterlockedIncrement64(&ScanStats.SigFilesRead);
+			InterlockedAdd64(&ScanStats.SigBytesRead, TotalRead);
+		}
+
+		ThisFile->Checksum.Sum += (unsigned int)Pending->FileSize;
+
+		if (SigCacheFileName)
+		{
+			SigCacheStore(Pending->FileName, Pending->FileSize, Pending->Mtime,
+				ThisFile->FileIndex.High, ThisFile->FileIndex.Low,
+				ThisFile->Checksum.Crc, ThisFile->Checksum.Sum);
+		}
+	}
+
+	// Record the signature under the physical file id, so other hardlinked
+	// paths to this file can inherit it without reading anything.
+	if (!HardlinkSearchMode && ThisFile->NumLinks > 1)
+		LinkSigStore(ThisFile->FileIndex.High, ThisFile->FileIndex.Low, &ThisFile->Checksum);
+
+	if (PrintFileSigs && !HardlinkSearchMode)
+	{
+		ClearProgressInd();
+		wprintf(L"%08lx%08lx %10llu %s\n", ThisFile->Checksum.Crc, ThisFile->Checksum.Sum, Pending->FileSize, Pending->FileName);
+	}
+
+	ThisFile->FileName = Pending->FileName; // The pending list owns the string.
+	EnterCriticalSection(&IndexLock);
+	CheckDuplicate(*ThisFile);
+	LeaveCriticalSection(&IndexLock);
+}
+
+//--------------------------------------------------------------------------
+// Synchronous scan of one file, used by the single threaded driver.
+//--------------------------------------------------------------------------
+static void ScanFile(PendingFile_t* Pending)
+{
+	static SigRead_t* Slot; // Only ever used from the phase two driver thread.
+	if (Slot == NULL)
+	{
+		Slot = (SigRead_t*)malloc(sizeof(SigRead_t));
+		if (Slot == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(Slot, 0, sizeof(*Slot));
+		for (int r = 0; r < 3; r++)
+			Slot->Overlapped[r].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	}
+	StartSignatureRead(Slot, Pending);
+	FinishSignatureRead(Slot);
+}
+
+//--------------------------------------------------------------------------
+// Hand one pending file to the worker pool.
+//--------------------------------------------------------------------------
+static void QueuePush(PendingFile_t* Pending)
+{
+	EnterCriticalSection(&QueueLock);
+	while (QueueCount >= WORK_QUEUE_DEPTH)
+	{
+		SleepConditionVariableCS(&QueueNotFull, &QueueLock, INFINITE);
+	}
+	WorkQueue[QueueTail] = Pending;
+	QueueTail = (QueueTail + 1) % WORK_QUEUE_DEPTH;
+	QueueCount += 1;
+	LeaveCriticalSection(&QueueLock);
+	WakeConditionVariable(&QueueNotEmpty);
+}
+
+//--------------------------------------------------------------------------
+// Retire the oldest in-flight read of a worker's pipeline.
+//--------------------------------------------------------------------------
+static void RetireSignatureRead(SigRead_t* Slot)
+{
+	FinishSignatureRead(Slot);
+	EnterCriticalSection(&QueueLock);
+	QueueBusyWorkers -= 1; // Counts popped but unfinished files.
+	if (QueueCount == 0 && QueueBusyWorkers == 0)
+		WakeAllConditionVariable(&QueueIdle);
+	LeaveCriticalSection(&QueueLock);
+}
+
+//--------------------------------------------------------------------------
+// Checksum worker thread.  Pops pending files and runs them through a
+// small pipeline of overlapped signature reads, so several reads are on
+// the device at once; returns when the queue is closed and empty.
+//--------------------------------------------------------------------------
+static unsigned __stdcall ScanWorker(void* arg)
+{
+	SigRead_t* Slots;
+	size_t NextStart = 0, NextFinish = 0, InFlight = 0, a;
+	(void)arg;
+
+	Slots = (SigRead_t*)calloc(SIG_PIPELINE_DEPTH, sizeof(SigRead_t));
+	if (Slots == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (a = 0; a < SIG_PIPELINE_DEPTH; a++)
+	{
+		for (int r = 0; r < 3; r++)
+			Slots[a].Overlapped[r].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	}
+
+	for (;;)
+	{
+		PendingFile_t* Pending;
+		EnterCriticalSection(&QueueLock);
+		if (QueueCount == 0 && !QueueClosed && InFlight > 0)
+		{
+			// No work ready; drain the pipeline rather than sitting on
+			// unfinished reads while blocked on the queue.
+			LeaveCriticalSection(&QueueLock);
+			RetireSignatureRead(&Slots[NextFinish]);
+			NextFinish = (NextFinish + 1) % SIG_PIPELINE_DEPTH;
+			InFlight -= 1;
+			continue;
+		}
+		while (QueueCount == 0 && !QueueClosed)
+		{
+			SleepConditionVariableCS(&QueueNotEmpty, &QueueLock, INFINITE);
+		}
+		if (QueueCount == 0)
+		{
+			// Queue closed and drained.
+			LeaveCriticalSection(&QueueLock);
+			break;
+		}
+		Pending = WorkQueue[QueueHead];
+		QueueHead = (QueueHead + 1) % WORK_QUEUE_DEPTH;
+		QueueCount -= 1;
+		QueueBusyWorkers += 1;
+		LeaveCriticalSection(&QueueLock);
+		WakeConditionVariable(&QueueNotFull);
+
+		if (InFlight == SIG_PIPELINE_DEPTH)
+		{
+			RetireSignatureRead(&Slots[NextFinish]);
+			NextFinish = (NextFinish + 1) % SIG_PIPELINE_DEPTH;
+			InFlight -= 1;
+		}
+		StartSignatureRead(&Slots[NextStart], Pending);
+		NextStart = (NextStart + 1) % SIG_PIPELINE_DEPTH;
+		InFlight += 1;
+	}
+
+	while (InFlight)
+	{
+		RetireSignatureRead(&Slots[NextFinish]);
+		NextFinish = (NextFinish + 1) % SIG_PIPELINE_DEPTH;
+		InFlight -= 1;
+	}
+	for (a = 0; a < SIG_PIPELINE_DEPTH; a++)
+	{
+		for (int r = 0; r < 3; r++)
+			CloseHandle(Slots[a].Overlapped[r].hEvent);
+	}
+	free(Slots);
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+// Start, drain and stop the worker pool.
+//--------------------------------------------------------------------------
+static void StartScanWorkers(void)
+{
+	int a;
+	InitializeCriticalSection(&QueueLock);
+	InitializeCriticalSection(&IndexLock);
+	InitializeCriticalSection(&CollectLock);
+	InitializeCriticalSection(&LinkSigLock);
+	InitializeCriticalSection(&MftEnumLock);
+	InitializeConditionVariable(&QueueNotEmpty);
+	InitializeConditionVariable(&QueueNotFull);
+	InitializeConditionVariable(&QueueIdle);
+	if (ThreadCount <= 1)
+		return; // Single threaded scan runs inline; only the locks are needed.
+	WorkerThreads = (HANDLE*)malloc(ThreadCount * sizeof(HANDLE));
+	if (WorkerThreads == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (a = 0; a < ThreadCount; a++)
+	{
+		WorkerThreads[a] = (HANDLE)_beginthreadex(NULL, 0, ScanWorker, NULL, 0, NULL);
+		if (WorkerThreads[a] == 0)
+		{
+			fwprintf(stderr, L"Could not start worker thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void DrainScanWorkers(void)
+{
+	// Wait until all queued files have been fully processed.  Needed between
+	// patterns because the reference flag may change for the next pattern.
+	EnterCriticalSection(&QueueLock);
+	while (QueueCount != 0 || QueueBusyWorkers != 0)
+	{
+		SleepConditionVariableCS(&QueueIdle, &QueueLock, INFINITE);
+	}
+	LeaveCriticalSection(&QueueLock);
+}
+
+static void StopScanWorkers(void)
+{
+	int a;
+	if (WorkerThreads == NULL)
+		return;
+	EnterCriticalSection(&QueueLock);
+	QueueClosed = true;
+	LeaveCriticalSection(&QueueLock);
+	WakeAllConditionVariable(&QueueNotEmpty);
+	for (a = 0; a < ThreadCount; a++)
+	{
+		WaitForSingleObject(WorkerThreads[a], INFINITE);
+		CloseHandle(WorkerThreads[a]);
+	}
+	free(WorkerThreads);
+	WorkerThreads = NULL;
+}
+
+//--------------------------------------------------------------------------
+// Count one file of the given size, growing the bucket table as needed.
+//--------------------------------------------------------------------------
+static void SizeCountAdd(ULONGLONG FileSize)
+{
+	size_t Slot;
+	if (SizeTableUsed * 3 >= SizeTableSize * 2)
+	{
+		// Grow (or create) the table and rehash.
+		ULONGLONG* OldKeys = SizeKeys;
+		unsigned int* OldCounts = SizeCounts;
+		size_t OldSize = SizeTableSize, a;
+		SizeTableSize = SizeTableSize ? SizeTableSize * 2 : 4096;
+		SizeKeys = (ULONGLONG*)calloc(SizeTableSize, sizeof(ULONGLONG));
+		SizeCounts = (unsigned int*)calloc(SizeTableSize, sizeof(unsigned int));
+		if (SizeKeys == NULL || SizeCounts == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		for (a = 0; a < OldSize; a++)
+		{
+			if (OldCounts[a] == 0)
+				continue;
+			Slot = (size_t)((OldKeys[a] * 0x9E3779B97F4A7C15ull) & (SizeTableSize - 1));
+			while (SizeCounts[Slot])
+				Slot = (Slot + 1) & (SizeTableSize - 1);
+			SizeKeys[Slot] = OldKeys[a];
+			SizeCounts[Slot] = OldCounts[a];
+		}
+		free(OldKeys);
+		free(OldCounts);
+	}
+
+	Slot = (size_t)((FileSize * 0x9E3779B97F4A7C15ull) & (SizeTableSize - 1));
+	while (SizeCounts[Slot] && SizeKeys[Slot] != FileSize)
+		Slot = (Slot + 1) & (SizeTableSize - 1);
+	if (SizeCounts[Slot] == 0)
+	{
+		SizeKeys[Slot] = FileSize;
+		SizeTableUsed += 1;
+	}
+	SizeCounts[Slot] += 1;
+}
+
+//--------------------------------------------------------------------------
+// How many scanned files share this size.
+//--------------------------------------------------------------------------
+static unsigned int SizeCountGet(ULONGLONG FileSize)
+{
+	size_t Slot = (size_t)((FileSize * 0x9E3779B97F4A7C15ull) & (SizeTableSize - 1));
+	while (SizeCounts[Slot] && SizeKeys[Slot] != FileSize)
+		Slot = (Slot + 1) & (SizeTableSize - 1);
+	return SizeCounts[Slot];
+}
+
+// Serialized reference index (-refindex).  A -ref pass against a huge
+// static corpus can be saved once and memory mapped by later runs, so
+// startup against the reference set is a single map plus index inserts
+// instead of re-enumerating and re-checksumming millions of files.  The
+// format is relocatable: records refer to their names by offset into a
+// string region at the end of the file, and the loaded view stays mapped
+// for the whole run so FileData can point straight into it.
+#define REFINDEX_MAGIC "FDRI"
+#define REFINDEX_VERSION 1
+#define REFINDEX_FLAG_LEGACY 1 // Signatures use the legacy byte-wise kernel.
+
+typedef struct
+{
+	char Magic[4];
+	unsigned int Version;
+	unsigned int Flags;
+	ULONGLONG Count;
+	ULONGLONG StringChars; // WCHARs in the string region after the records.
+} RefIndexHeader_t;
+
+typedef struct
+{
+	Checksum_t Checksum;
+	ULONGLONG FileSize;
+	__time64_t Mtime;
+	DWORD IndexHigh, IndexLow;
+	DWORD NumLinks;
+	DWORD Attributes;
+	ULONGLONG NameOffset;  // WCHARs into the string region.
+} RefIndexRecord_t;
+
+static bool RefIndexLoaded; // Existing index was mapped; do not rewrite it.
+
+//--------------------------------------------------------------------------
+// Map an existing reference index and insert its records.  Returns false
+// if the file does not exist yet (the run will then write it at the end).
+//--------------------------------------------------------------------------
+static bool RefIndexLoad(const WCHAR* FileName)
+{
+	HANDLE File, Map;
+	LARGE_INTEGER MapSize;
+	BYTE* View;
+	const RefIndexHeader_t* Header;
+	const RefIndexRecord_t* Records;
+	const WCHAR* Strings;
+	ULONGLONG a;
+
+	File = CreateFileW(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File == INVALID_HANDLE_VALUE)
+		return false; // First run; index gets written after the scan.
+
+	if (!GetFileSizeEx(File, &MapSize) || (ULONGLONG)MapSize.QuadPart < sizeof(RefIndexHeader_t))
+	{
+		fwprintf(stderr, L"'%s' is not a finddupe reference index.\n", FileName);
+		exit(EXIT_FAILURE);
+	}
+	Map = CreateFileMappingW(File, NULL, PAGE_READONLY, 0, 0, NULL);
+	View = Map ? (BYTE*)MapViewOfFile(Map, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (View == NULL)
+	{
+		fwprintf(stderr, L"Could not map reference index '%s'.\n", FileName);
+		exit(EXIT_FAILURE);
+	}
+
+	Header = (const RefIndexHeader_t*)View;
+	if (memcmp(Header->Magic, REFINDEX_MAGIC, 4) != 0 || Header->Version != REFINDEX_VERSION)
+	{
+		fwprintf(stderr, L"'%s' is not a finddupe reference index.\n", FileName);
+		exit(EXIT_FAILURE);
+	}
+	if ((Header->Flags & REFINDEX_FLAG_LEGACY) != (CalcSignature == CalcCrc ? REFINDEX_FLAG_LEGACY : 0u))
+	{
+		fwprintf(stderr, L"Reference index '%s' was built with a different signature kernel.\n"
+			L"Rebuild it, or match the -legacysigs setting of the run that built it.\n", FileName);
+		exit(EXIT_FAILURE);
+	}
+
+	// An interrupted save can leave a short file; make sure the declared
+	// records and string region actually fit in the mapping before walking
+	// it, or a truncated index crashes instead of erroring out.
+	if (Header->Count > ((ULONGLONG)MapSize.QuadPart - sizeof(RefIndexHeader_t)) / sizeof(RefIndexRecord_t)
+		|| Header->StringChars > ((ULONGLONG)MapSize.QuadPart - sizeof(RefIndexHeader_t)
+			- Header->Count * sizeof(RefIndexRecord_t)) / sizeof(WCHAR))
+	{
+		fwprintf(stderr, L"Reference index '%s' is truncated; rebuild it.\n", FileName);
+		exit(EXIT_FAILURE);
+	}
+
+	Records = (const RefIndexRecord_t*)(View + sizeof(RefIndexHeader_t));
+	Strings = (const WCHAR*)(Records + Header->Count);
+
+	// Every name must end inside the string region.
+	if (Header->StringChars != 0 && Strings[Header->StringChars - 1] != L'\0')
+	{
+		fwprintf(stderr, L"Reference index '%s' is truncated; rebuild it.\n", FileName);
+		exit(EXIT_FAILURE);
+	}
+
+	for (a = 0; a < Header->Count; a++)
+	{
+		FileData_t ThisFile;
+		memset(&ThisFile, 0, sizeof(ThisFile));
+		ThisFile.Checksum = Records[a].Checksum;
+		ThisFile.FileSize = Records[a].FileSize;
+		ThisFile.Mtime = Records[a].Mtime;
+		ThisFile.FileIndex.High = Records[a].IndexHigh;
+		ThisFile.FileIndex.Low = Records[a].IndexLow;
+		ThisFile.NumLinks = Records[a].NumLinks;
+		ThisFile.Attributes = Records[a].Attributes;
+		if (Records[a].NameOffset >= Header->StringChars)
+		{
+			fwprintf(stderr, L"Reference index '%s' is truncated; rebuild it.\n", FileName);
+			exit(EXIT_FAILURE);
+		}
+		ThisFile.FileName = (WCHAR*)(Strings + Records[a].NameOffset); // Points into the mapping.
+		ThisFile.IsReference = true;
+		// Register the size so incoming files sharing it are not skipped
+		// as size singletons, then insert into the index.
+		SizeCountAdd(ThisFile.FileSize);
+		CheckDuplicate(ThisFile);
+	}
+
+	// The view stays mapped for the whole run; FileData names point into it.
+	CloseHandle(File);
+	wprintf(L"Loaded %llu reference records from '%s'.\n", Header->Count, FileName);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+// Write every reference record of this run to the index file.
+//--------------------------------------------------------------------------
+static void RefIndexSave(const WCHAR* FileName)
+{
+	FILE* File = NULL;
+	WCHAR TmpName[_MAX_PATH * 2];
+	RefIndexHeader_t Header;
+	size_t a;
+	ULONGLONG NameOffset = 0;
+
+	memcpy(Header.Magic, REFINDEX_MAGIC, 4);
+	Header.Version = REFINDEX_VERSION;
+	Header.Flags = CalcSignature == CalcCrc ? REFINDEX_FLAG_LEGACY : 0;
+	Header.Count = 0;
+	Header.StringChars = 0;
+	for (a = 1; a < NumUnique; a++)
+	{
+		if (!FileData[a].IsReference)
+			continue;
+		Header.Count += 1;
+		Header.StringChars += wcslen(FileData[a].FileName) + 1;
+	}
+
+	// Write to a temp file and rename into place, so an interrupted or
+	// disk-full save cannot leave a short index for the next run to map.
+	swprintf_s(TmpName, _MAX_PATH * 2, L"%s.tmp", FileName);
+	_wfopen_s(&File, TmpName, L"wb");
+	if (File == NULL)
+	{
+		fwprintf(stderr, L"Unable to create reference index '%s'.\n", TmpName);
+		return;
+	}
+	fwrite(&Header, sizeof(Header), 1, File);
+	for (a = 1; a < NumUnique; a++)
+	{
+		RefIndexRecord_t Record;
+		if (!FileData[a].IsReference)
+			continue;
+		Record.Checksum = FileData[a].Checksum;
+		Record.FileSize = FileData[a].FileSize;
+		Record.Mtime = FileData[a].Mtime;
+		Record.IndexHigh = FileData[a].FileIndex.High;
+		Record.IndexLow = FileData[a].FileIndex.Low;
+		Record.NumLinks = FileData[a].NumLinks;
+		Record.Attributes = FileData[a].Attributes;
+		Record.NameOffset = NameOffset;
+		NameOffset += wcslen(FileData[a].FileName) + 1;
+		fwrite(&Record, sizeof(Record), 1, File);
+	}
+	for (a = 1; a < NumUnique; a++)
+	{
+		if (!FileData[a].IsReference)
+			continue;
+		fwrite(FileData[a].FileName, sizeof(WCHAR), wcslen(FileData[a].FileName) + 1, File);
+	}
+	fflush(File);
+	if (ferror(File))
+	{
+		fclose(File);
+		DeleteFileW(TmpName);
+		fwprintf(stderr, L"Unable to write reference index '%s'.\n", TmpName);
+		return;
+	}
+	fclose(File);
+
+	if (!MoveFileExW(TmpName, FileName, MOVEFILE_REPLACE_EXISTING))
+	{
+		fwprintf(stderr, L"Unable to replace reference index '%s'.\n", FileName);
+		return;
+	}
+	wprintf(L"Saved %llu reference records to '%s'.\n", Header.Count, FileName);
+}
+
+//--------------------------------------------------------------------------
+// Checkpoint and resume support (-checkpoint).  Multi-hour scans snapshot
+// the duplicate index (FileData, chains and names), the summary counters
+// and the position in the pending list every half minute, so an
+// interrupted run restarts where it left off instead of losing
+// everything.  Snapshots are taken at quiescent points - the worker
+// queue is drained first - so "position N" means every pending entry
+// before N is fully merged.  On resume the pending list is rebuilt by a
+// normal traversal (cheap; no file contents are read in phase one) and
+// a fingerprint of the already-processed prefix is checked, so a tree
+// that changed since the snapshot falls back to a fresh scan instead of
+// skipping the wrong files.  The snapshot is written to a temp file and
+// renamed into place, so a crash mid-write cannot eat the previous one.
+//--------------------------------------------------------------------------
+#define CHECKPOINT_MAGIC "FDCP"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_FLAG_LEGACY 1   // Signatures use the legacy byte-wise kernel.
+#define CHECKPOINT_FLAG_LISTLINK 2 // Snapshot of a -listlink scan; checksums hold file ids.
+#define CHECKPOINT_INTERVAL_MS 30000
+
+typedef struct
+{
+	char Magic[4];
+	unsigned int Version;
+	unsigned int Flags;
+	ULONGLONG NumRecords;  // FileData entries excluding the unused slot 0.
+	ULONGLONG Processed;   // Merged pending entries still on disk (own -del removals excluded).
+	ULONGLONG PendingHash; // Fingerprint of those surviving prefix entries.
+	ULONGLONG StringChars; // WCHARs in the string region after the records.
+} CheckpointHeader_t;
+
+typedef struct
+{
+	Checksum_t Checksum;
+	ULONGLONG FileSize;
+	__time64_t Mtime;
+	DWORD IndexHigh, IndexLow;
+	DWORD NumLinks;
+	DWORD Attributes;
+	ULONGLONG Same;
+	DWORD IsReference;
+	DWORD Pad;
+	ULONGLONG NameOffset; // WCHARs into the string region.
+} CheckpointRecord_t;
+
+// Snapshot loaded at startup; applied (or discarded) once the pending
+// list exists and the prefix fingerprint can be checked.
+static CheckpointHeader_t CkptHeader;
+static CheckpointRecord_t* CkptRecords;
+static WCHAR* CkptStrings;
+static BYTE CkptDupeStats[sizeof(DupeStats)];
+static ULONGLONG CkptLastSaveTick;
+
+// Names this run's own -del actions removed (arena strings).  A resumed
+// traversal will not find those files again, so fingerprints must leave
+// them out or an interrupted -del run could never match its snapshot.
+// Appended under the index lock; sorted and searched only at quiescent
+// snapshot points on the main thread.
+static const WCHAR** CkptDeleted;
+static size_t CkptNumDeleted, CkptDeletedAlloc;
+static bool CkptDeletedSorted;
+
+static int CompareDeletedName(const void* p1, const void* p2)
+{
+	return wcscmp(*(const WCHAR* const*)p1, *(const WCHAR* const*)p2);
+}
+
+static void CheckpointNoteDeleted(const WCHAR* FileName)
+{
+	if (CkptNumDeleted >= CkptDeletedAlloc)
+	{
+		CkptDeletedAlloc = CkptDeletedAlloc + 1024 + CkptDeletedAlloc / 2;
+#pragma warning(disable:6308)
+		CkptDeleted = (const WCHAR**)realloc(CkptDeleted, CkptDeletedAlloc * sizeof(WCHAR*));
+		if (CkptDeleted == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	CkptDeleted[CkptNumDeleted] = FileName;
+	CkptNumDeleted += 1;
+	CkptDeletedSorted = false;
+}
+
+static bool CheckpointNameDeleted(const WCHAR* FileName)
+{
+	size_t Lo = 0, Hi = CkptNumDeleted;
+	while (Lo < Hi)
+	{
+		size_t Mid = Lo + (Hi - Lo) / 2;
+		int c = wcscmp(FileName, CkptDeleted[Mid]);
+		if (c == 0)
+			return true;
+		if (c < 0)
+			Hi = Mid;
+		else
+			Lo = Mid + 1;
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------
+// FNV-1a fingerprint of the first Count pending entries (name, size,
+// mtime), leaving out entries this run already deleted.  Cheap insurance
+// that the tree still produces the same processing order the snapshot
+// was taken against.  *NumHashed gets the number of entries actually
+// folded in - the prefix length a resumed run has to compare against,
+// since its rebuilt pending list no longer contains the deleted files.
+//--------------------------------------------------------------------------
+static ULONGLONG PendingPrefixHash(size_t Count, size_t* NumHashed)
+{
+	ULONGLONG Hash = 14695981039346656037ull;
+	size_t a, Hashed = 0;
+	const WCHAR* c;
+
+	if (!CkptDeletedSorted && CkptNumDeleted != 0)
+	{
+		qsort(CkptDeleted, CkptNumDeleted, sizeof(WCHAR*), CompareDeletedName);
+		CkptDeletedSorted = true;
+	}
+
+	for (a = 0; a < Count; a++)
+	{
+		if (CkptNumDeleted != 0 && CheckpointNameDeleted(PendingFiles[a].FileName))
+			continue;
+		for (c = PendingFiles[a].FileName; *c; c++)
+			Hash = (Hash ^ (ULONGLONG)*c) * 1099511628211ull;
+		Hash = (Hash ^ PendingFiles[a].FileSize) * 1099511628211ull;
+		Hash = (Hash ^ (ULONGLONG)PendingFiles[a].Mtime) * 1099511628211ull;
+		Hashed += 1;
+	}
+	*NumHashed = Hashed;
+	return Hash;
+}
+
+//--------------------------------------------------------------------------
+// Write a snapshot.  Caller has drained the worker queue, so FileData is
+// consistent and every pending entry before Processed is merged.
+//--------------------------------------------------------------------------
+static void CheckpointSave(size_t Processed)
+{
+	FILE* File = NULL;
+	WCHAR TmpName[_MAX_PATH * 2];
+	CheckpointHeader_t Header;
+	size_t a, Survivors;
+	ULONGLONG NameOffset = 0;
+
+	if (ActionFailed)
+		return; // Noted deletions may not all have happened; keep the last good snapshot.
+
+	memcpy(Header.Magic, CHECKPOINT_MAGIC, 4);
+	Header.Version = CHECKPOINT_VERSION;
+	Header.Flags = CalcSignature == CalcCrc ? CHECKPOINT_FLAG_LEGACY : 0;
+	if (HardlinkSearchMode)
+		Header.Flags |= CHECKPOINT_FLAG_LISTLINK;
+	Header.NumRecords = NumUnique - 1;
+	Header.PendingHash = PendingPrefixHash(Processed, &Survivors);
+	// Stored in terms a resumed run can check: deleted files will be gone
+	// from its rebuilt pending list, so only the survivors count.
+	Header.Processed = Survivors;
+	Header.StringChars = 0;
+	for (a = 1; a < NumUnique; a++)
+		Header.StringChars += wcslen(FileData[a].FileName) + 1;
+
+	swprintf_s(TmpName, _MAX_PATH * 2, L"%s.tmp", CheckpointFileName);
+	_wfopen_s(&File, TmpName, L"wb");
+	if (File == NULL)
+	{
+		fwprintf(stderr, L"Unable to write checkpoint '%s'.\n", TmpName);
+		return;
+	}
+	fwrite(&Header, sizeof(Header), 1, File);
+	fwrite(&DupeStats, sizeof(DupeStats), 1, File);
+	for (a = 1; a < NumUnique; a++)
+	{
+		CheckpointRecord_t Record;
+		memset(&Record, 0, sizeof(Record));
+		Record.Checksum = FileData[a].Checksum;
+		Record.FileSize = FileData[a].FileSize;
+		Record.Mtime = FileData[a].Mtime;
+		Record.IndexHigh = FileData[a].FileIndex.High;
+		Record.IndexLow = FileData[a].FileIndex.Low;
+		Record.NumLinks = FileData[a].NumLinks;
+		Record.Attributes = FileData[a].Attributes;
+		Record.Same = FileData[a].Same;
+		Record.IsReference = FileData[a].IsReference ? 1 : 0;
+		Record.NameOffset = NameOffset;
+		NameOffset += wcslen(FileData[a].FileName) + 1;
+		fwrite(&Record, sizeof(Record), 1, File);
+	}
+	for (a = 1; a < NumUnique; a++)
+		fwrite(FileData[a].FileName, sizeof(WCHAR), wcslen(FileData[a].FileName) + 1, File);
+	fclose(File);
+
+	if (!MoveFileExW(TmpName, CheckpointFileName, MOVEFILE_REPLACE_EXISTING))
+		fwprintf(stderr, L"Unable to replace checkpoint '%s'.\n", CheckpointFileName);
+}
+
+//--------------------------------------------------------------------------
+// Read an existing snapshot into memory.  A missing file is fine (fresh
+// run); a snapshot from an incompatible mode is ignored with a warning.
+//--------------------------------------------------------------------------
+static void CheckpointLoad(void)
+{
+	FILE* File = NULL;
+	unsigned int WantFlags;
+
+	_wfopen_s(&File, CheckpointFileName, L"rb");
+	if (File == NULL)
+		return;
+
+	WantFlags = CalcSignature == CalcCrc ? CHECKPOINT_FLAG_LEGACY : 0;
+	if (HardlinkSearchMode)
+		WantFlags |= CHECKPOINT_FLAG_LISTLINK;
+
+	if (fread(&CkptHeader, sizeof(CkptHeader), 1, File) != 1
+		|| memcmp(CkptHeader.Magic, CHECKPOINT_MAGIC, 4) != 0
+		|| CkptHeader.Version != CHECKPOINT_VERSION
+		|| CkptHeader.Flags != WantFlags
+		|| fread(CkptDupeStats, sizeof(CkptDupeStats), 1, File) != 1)
+	{
+		fclose(File);
+		fwprintf(stderr, L"Ignoring checkpoint '%s': different format or scan mode.\n", CheckpointFileName);
+		return;
+	}
+
+	CkptRecords = (CheckpointRecord_t*)malloc((size_t)CkptHeader.NumRecords * sizeof(CheckpointRecord_t));
+	CkptStrings = (WCHAR*)malloc((size_t)CkptHeader.StringChars * sizeof(WCHAR));
+	if (CkptRecords == NULL || CkptStrings == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fread(CkptRecords, sizeof(CheckpointRecord_t), (size_t)CkptHeader.NumRecords, File) != CkptHeader.NumRecords
+		|| fread(CkptStrings, sizeof(WCHAR), (size_t)CkptHeader.StringChars, File) != CkptHeader.StringChars)
+	{
+		fclose(File);
+		fwprintf(stderr, L"Ignoring checkpoint '%s': truncated.\n", CheckpointFileName);
+		free(CkptRecords);
+		free(CkptStrings);
+		CkptRecords = NULL;
+		CkptStrings = NULL;
+		return;
+	}
+	fclose(File);
+}
+
+//--------------------------------------------------------------------------
+// Apply the loaded snapshot once the sorted pending list exists.  Returns
+// the position to resume from (0 if there is no usable snapshot).
+//--------------------------------------------------------------------------
+static size_t CheckpointApply(void)
+{
+	ULONGLONG a;
+	size_t idx, Slot, Hashed;
+
+	if (CkptRecords == NULL)
+		return 0;
+
+	if (CkptHeader.Processed > NumPending
+		|| PendingPrefixHash((size_t)CkptHeader.Processed, &Hashed) != CkptHeader.PendingHash
+		|| Hashed != CkptHeader.Processed)
+	{
+		fwprintf(stderr, L"Checkpoint no longer matches the tree; starting over.\n");
+		free(CkptRecords);
+		free(CkptStrings);
+		CkptRecords = NULL;
+		CkptStrings = NULL;
+		return 0;
+	}
+
+	// Rebuild FileData from the records; chains come back via Same.
+	if ((size_t)CkptHeader.NumRecords + 1 > NumAllocated)
+	{
+		NumAllocated = (size_t)CkptHeader.NumRecords + 1024;
+#pragma warning(disable:6308)
+		FileData = (FileData_t*)realloc(FileData, NumAllocated * sizeof(FileData_t));
+		if (FileData == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (a = 0; a < CkptHeader.NumRecords; a++)
+	{
+		FileData_t* Entry = &FileData[a + 1];
+		memset(Entry, 0, sizeof(*Entry));
+		Entry->Checksum = CkptRecords[a].Checksum;
+		Entry->FileSize = CkptRecords[a].FileSize;
+		Entry->Mtime = CkptRecords[a].Mtime;
+		Entry->FileIndex.High = CkptRecords[a].IndexHigh;
+		Entry->FileIndex.Low = CkptRecords[a].IndexLow;
+		Entry->NumLinks = CkptRecords[a].NumLinks;
+		Entry->Attributes = CkptRecords[a].Attributes;
+		Entry->Same = (size_t)CkptRecords[a].Same;
+		Entry->IsReference = CkptRecords[a].IsReference != 0;
+		Entry->FileName = StrArenaDup(CkptStrings + CkptRecords[a].NameOffset);
+	}
+	NumUnique = (size_t)CkptHeader.NumRecords + 1;
+
+	// Rebuild the checksum index: the first entry with a given checksum is
+	// its chain head (chains only ever link forward).
+	while (NumUnique * 3 >= CkIndexSize * 2)
+		GrowCkIndex();
+	for (idx = 1; idx < NumUnique; idx++)
+	{
+		Slot = HashChecksum(&FileData[idx].Checksum) & (CkIndexSize - 1);
+		while (CkIndex[Slot] != 0
+			&& memcmp(&FileData[idx].Checksum, &CkSums[Slot], sizeof(Checksum_t)) != 0)
+		{
+			Slot = (Slot + 1) & (CkIndexSize - 1);
+		}
+		if (CkIndex[Slot] == 0)
+		{
+			CkIndex[Slot] = idx;
+			CkSums[Slot] = FileData[idx].Checksum;
+		}
+	}
+
+	// Restore the summary counters, except the two the fresh traversal
+	// just recounted in full.
+	{
+		ULONGLONG CantRead = DupeStats.CantReadFiles;
+		ULONGLONG ZeroLen = DupeStats.ZeroLengthFiles;
+		memcpy(&DupeStats, CkptDupeStats, sizeof(DupeStats));
+		DupeStats.CantReadFiles = CantRead;
+		DupeStats.ZeroLengthFiles = ZeroLen;
+	}
+
+	free(CkptRecords);
+	free(CkptStrings);
+	CkptRecords = NULL;
+	CkptStrings = NULL;
+
+	ClearProgressInd();
+	wprintf(L"Resuming from checkpoint: %llu of %llu files already processed.\n",
+		CkptHeader.Processed, (ULONGLONG)NumPending);
+	return (size_t)CkptHeader.Processed;
+}
+
+//--------------------------------------------------------------------------
+// Per-volume scheduling of the command line patterns.  The patterns are
+// parsed into this list up front; when they span more than one volume (and
+// -t allows more than one thread), each volume gets its own traversal
+// thread, so one slow drive cannot stall scanning of the others.  Each
+// volume thread traverses sequentially - the subtree worker pool in
+// myglob.c is not reentrant, so the threads go to volumes instead.
+//--------------------------------------------------------------------------
+typedef struct
+{
+	WCHAR* Pattern;
+	WCHAR Drive;
+	bool IsReference;
+	unsigned int Ordinal;
+	ULONGLONG Matched;
+} PatternEntry_t;
+
+static PatternEntry_t* PatternList;
+static size_t NumPatterns;
+static bool PerVolumeActive;
+static __declspec(thread) PatternEntry_t* CurrentPattern; // Pattern being expanded by this thread.
+
+//--------------------------------------------------------------------------
+// Per file callback from the glob walker (phase one).  Stats the file and
+// records it on the pending list; no file contents are read here.
+//--------------------------------------------------------------------------
+static void ProcessFileLocked(const WCHAR* FileName)
+{
+	if (PerVolumeActive)
+		CurrentPattern->Matched += 1;
+	else
+		FilesMatched += 1;
+	ScanStats.FilesFound += 1;
+
+	if (BatchFileName && wcscmp(FileName, BatchFileName) == 0)
+		return;
+
+	if (PlanFileName && wcscmp(FileName, PlanFileName) == 0)
+		return;
+
+	if (OutFileName && wcscmp(FileName, OutFileName) == 0)
+		return;
+
+	if (CheckpointFileName)
+	{
+		// The checkpoint (and its temp sibling) is rewritten every half
+		// minute; scanning it would poison the resume fingerprint.
+		size_t Len = wcslen(CheckpointFileName);
+		if (wcsncmp(FileName, CheckpointFileName, Len) == 0
+			&& (FileName[Len] == L'\0' || wcscmp(FileName + Len, L".tmp") == 0))
+			return;
+	}
+
+	struct _stat64 FileStat;
+	if (_wstat64(FileName, &FileStat) != 0)
+	{
+		DupeStats.CantReadFiles += 1;
+		if (!HideCantReadMessage)
+		{
+			ClearProgressInd();
+			fwprintf(stderr, L"Could not read '%s'.\n", FileName);
 		}
+		return;
 	}
 
-store_it:
+	if (FileStat.st_size == 0 && SkipZeroLength)
+	{
+		DupeStats.ZeroLengthFiles += 1;
+		return;
+	}
 
-	if (NumUnique >= NumAllocated)
+	if (NumPending >= PendingAllocated)
 	{
-		// Array is full.  Make it bigger
-		NumAllocated = NumAllocated + NumAllocated / 2;
+		PendingAllocated = PendingAllocated ? PendingAllocated + PendingAllocated / 2 : 1024;
 #pragma warning(disable:6308)
-		FileData = (FileData_t*)realloc(FileData, NumAllocated * sizeof(FileData_t));
-		if (FileData == NULL)
+		PendingFiles = (PendingFile_t*)realloc(PendingFiles, PendingAllocated * sizeof(PendingFile_t));
+		if (PendingFiles == NULL)
 		{
 			fwprintf(stderr, L"Malloc failure.\n");
 			exit(EXIT_FAILURE);
 		}
 	}
-#pragma warning(disable:6386)
-	FileData[NumUnique] = ThisFile;
-	NumUnique += 1;
+
+	PendingFile_t* Pending = &PendingFiles[NumPending];
+	Pending->FileName = StrArenaDup(FileName);
+	Pending->FileSize = FileStat.st_size;
+	Pending->Mtime = FileStat.st_mtime;
+	if (PerVolumeActive)
+	{
+		Pending->IsReference = CurrentPattern->IsReference;
+		Pending->PatternOrdinal = CurrentPattern->Ordinal;
+	}
+	else
+	{
+		Pending->IsReference = ReferenceFiles;
+		Pending->PatternOrdinal = CurrentPatternOrdinal;
+	}
+	NumPending += 1;
+	SizeCountAdd(Pending->FileSize);
+	ProgressFileName = Pending->FileName; // Arena string; safe for racy reads.
 }
 
 //--------------------------------------------------------------------------
-// Walk the file tree after handling detect mode to show linked groups.
+// Glob callback wrapper.  Traversal may run on several threads, so the
+// phase one state is guarded by one lock.
 //--------------------------------------------------------------------------
-static void ShowLinkGroups(size_t index)
+static void ProcessFile(const WCHAR* FileName)
 {
-	if (NumUnique == 1 || index == 0)
-		return;
+	EnterCriticalSection(&CollectLock);
+	ProcessFileLocked(FileName);
+	LeaveCriticalSection(&CollectLock);
+}
+
+//--------------------------------------------------------------------------
+// Expand one command line pattern into ProcessFile calls.
+//--------------------------------------------------------------------------
+static void RunPattern(PatternEntry_t* Pattern)
+{
+	CurrentPattern = Pattern;
 
-	if (FileData[index].NumLinks > 1)
+	// A pattern like c:\** covers the entire volume, so with -mft the file
+	// list can come straight from the master file table instead of a
+	// directory walk.  Anything fancier still goes through the glob.
+	if (UseMftScan && Pattern->Pattern[1] == L':' && !wcscmp(Pattern->Pattern + 2, L"\\**"))
 	{
-		size_t GroupLen = 0, Ptr = index;
-		wprintf(L"\nHardlink group %llu\n", DupeStats.HardlinkGroups);
-		while (Ptr)
-		{
-			wprintf(L"  \"%s\"\n", FileData[Ptr].FileName);
-			GroupLen += 1;
-			Ptr = FileData[Ptr].Same;
-		}
-		wprintf(L"Hardlink group, %llu of %lu hardlinked instances found in search tree:\n", GroupLen, FileData[index].NumLinks);
-		DupeStats.HardlinkGroups += 1;
+		int Res;
+		EnterCriticalSection(&MftEnumLock);
+		Res = MyMftEnum(towupper(Pattern->Pattern[0]), ProcessFile);
+		LeaveCriticalSection(&MftEnumLock);
+		if (Res == 0)
+			return;
+		fwprintf(stderr, L"Falling back to directory walk for '%s'.\n", Pattern->Pattern);
 	}
 
-	ShowLinkGroups(FileData[index].Larger);
-	ShowLinkGroups(FileData[index].Smaller);
+	// Use my globbing module to do fancier wildcard expansion with recursive
+	// subdirectories under Windows.
+	MyGlob(Pattern->Pattern, FollowReparse, ProcessFile);
 }
 
 //--------------------------------------------------------------------------
-// Do selected operations to one file at a time.
+// One traversal thread per volume: runs that volume's patterns in their
+// command line order, feeding the shared pending list.
 //--------------------------------------------------------------------------
-static void ProcessFile(const WCHAR* FileName)
+static unsigned __stdcall VolumeScanThread(void* arg)
 {
-	FileData_t ThisFile;
-	memset(&ThisFile, 0, sizeof(ThisFile));
-
+	WCHAR Drive = (WCHAR)(ULONG_PTR)arg;
+	size_t a;
+	for (a = 0; a < NumPatterns; a++)
 	{
-		static ULONGLONG LastPrint = 0, Now;
-		Now = GetTickCount64();
-		if ((unsigned)(Now - LastPrint) > 500)
-		{
-			if (ShowProgress)
-			{
-				WCHAR ShowName[105];
-				ULONGLONG l = wcslen(FileName);
-				memset(ShowName, L'\0', sizeof(ShowName));
-				if (l > 100)
-					l = 101;
-				memcpy(ShowName, FileName, l * sizeof(WCHAR));
-				if (l >= 101)
-					memcpy(ShowName + 100, L"...", 4 * sizeof(WCHAR));
-
-				ClearProgressInd();
-				wprintf(L"Scanned %4llu files: %ls", FilesMatched, ShowName);
-				ProgressIndicatorVisible = true;
-				LastPrint = Now;
-				ProgressIndicatorVisible = 1;
-			}
-			fflush(stdout);
-		}
+		if (PatternList[a].Drive == Drive)
+			RunPattern(&PatternList[a]);
 	}
+	return 0;
+}
 
-	FilesMatched += 1;
+//--------------------------------------------------------------------------
+// Restore a deterministic processing order after parallel traversal:
+// by pattern first, then by path, which is what the sequential walker
+// produced by construction.
+//--------------------------------------------------------------------------
+static int ComparePending(const void* p1, const void* p2)
+{
+	const PendingFile_t* f1 = (const PendingFile_t*)p1;
+	const PendingFile_t* f2 = (const PendingFile_t*)p2;
+	if (f1->PatternOrdinal != f2->PatternOrdinal)
+		return f1->PatternOrdinal < f2->PatternOrdinal ? -1 : 1;
+	return wcscmp(f1->FileName, f2->FileName);
+}
 
-	if (BatchFileName && wcscmp(FileName, BatchFileName) == 0)
-		return;
+//--------------------------------------------------------------------------
+// Phase two: compute signatures and check for duplicates.  Files whose size
+// no other scanned file shares are counted and skipped without ever being
+// opened - a unique size can never be a duplicate.  -sigs and -listlink
+// need every file, so the skip is disabled for those modes.
+//--------------------------------------------------------------------------
+static void ProcessPendingFiles(void)
+{
+	size_t a, Resume = 0;
+	bool SkipSingletons = !HardlinkSearchMode && !PrintFileSigs;
 
-	struct _stat64 FileStat;
-	if (_wstat64(FileName, &FileStat) != 0)
+	if (ThreadCount > 1)
 	{
-		// oops!
-		goto cant_read_file;
+		// Parallel traversal appends in completion order; sort it back.
+		qsort(PendingFiles, NumPending, sizeof(PendingFile_t), ComparePending);
 	}
-	size_t FileSize = FileStat.st_size;
 
-	if (FileSize == 0)
+	if (CheckpointFileName)
 	{
-		if (SkipZeroLength)
-		{
-			DupeStats.ZeroLengthFiles += 1;
-			return;
-		}
+		Resume = CheckpointApply();
+		CkptLastSaveTick = GetTickCount64();
 	}
 
-	ThisFile.FileSize = FileSize;
+	ProgressPhase = 1;
+	ProgressTotal = (LONGLONG)NumPending;
+	ProgressDone = (LONGLONG)Resume;
 
+	for (a = Resume; a < NumPending; a++)
 	{
-		HANDLE FileHandle;
-		BY_HANDLE_FILE_INFORMATION FileInfo;
-		FileHandle = CreateFileW(FileName,
-			GENERIC_READ,          // dwDesiredAccess
-			FILE_SHARE_READ,       // dwShareMode
-			NULL,                  // Security attirbutes
-			OPEN_EXISTING,         // dwCreationDisposition
-			FILE_ATTRIBUTE_NORMAL, // dwFlagsAndAttributes.  Ignored for opening existing files
-			NULL);                 // hTemplateFile.  Ignored for existing.
-		if (FileHandle == (void*)-1)
-		{
-		cant_read_file:
-			DupeStats.CantReadFiles += 1;
-			if (!HideCantReadMessage)
-			{
-				ClearProgressInd();
-				fwprintf(stderr, L"Could not read '%s'.\n", FileName);
-			}
-			return;
-		}
-
-		if (!GetFileInformationByHandle(FileHandle, &FileInfo))
-		{
-			CloseHandle(FileHandle);
-			goto cant_read_file;
-		}
-
-		CloseHandle(FileHandle);
+		PendingFile_t* Pending = &PendingFiles[a];
 
-		if (Verbose)
-		{
-			ClearProgressInd();
-			wprintf(L"Hardlinked (%lu links) node=%08lx %08lx: %s\n", FileInfo.nNumberOfLinks, FileInfo.nFileIndexHigh, FileInfo.nFileIndexLow, FileName);
-		}
+		ProgressDone += 1;
+		ProgressBytes += (LONGLONG)Pending->FileSize;
 
-		if (HardlinkSearchMode && FileInfo.nNumberOfLinks == 1)
+		if (SkipSingletons && SizeCountGet(Pending->FileSize) < 2)
 		{
-			// File has only one link, so its not hardlinked.  Skip for hardlink search mode.
-			return;
+			EnterCriticalSection(&IndexLock);
+			DupeStats.TotalFiles += 1;
+			DupeStats.TotalBytes += Pending->FileSize;
+			LeaveCriticalSection(&IndexLock);
+			continue;
 		}
 
-		//printf("    Info:  Index: %08x %08x\n",FileInfo.nFileIndexHigh, FileInfo.nFileIndexLow);
-
-		// Use the file index (which is NTFS equivalent of the iNode) instead of the CRC.
-		ThisFile.FileIndex.Low = FileInfo.nFileIndexLow;
-		ThisFile.FileIndex.High = FileInfo.nFileIndexHigh;
-		ThisFile.NumLinks = FileInfo.nNumberOfLinks;
-
-		if (HardlinkSearchMode)
-		{
-			// For hardlink search mode, duplicates are detected by file index, not CRC,
-			// so copy the file ID into the CRC.
-			ThisFile.Checksum.Sum = ThisFile.FileIndex.Low;
-			ThisFile.Checksum.Crc = ThisFile.FileIndex.High;
-		}
+		if (ThreadCount > 1)
+			QueuePush(Pending);
 		else
-		{
-			FILE* infile;
-			BYTE* FileBuffer = (BYTE*)malloc(BYTES_DO_CHECKSUM_OF);
-			if (FileBuffer == NULL)
-			{
-				fwprintf(stderr, L"Malloc failure.\n");
-				exit(EXIT_FAILURE);
-			}
-			Checksum_t CheckSum;
-			memset(&CheckSum, 0, sizeof(CheckSum));
-
-			_wfopen_s(&infile, FileName, L"rb");
-
-			if (infile == NULL)
-			{
-				if (!HideCantReadMessage)
-				{
-					ClearProgressInd();
-					fwprintf(stderr, L"Can't open '%s'.\n", FileName);
-				}
-				return;
-			}
-
-			size_t BytesToRead = FileSize > BYTES_DO_CHECKSUM_OF ? BYTES_DO_CHECKSUM_OF : FileSize;
-			size_t BytesRead = fread(FileBuffer, 1, BytesToRead, infile);
-			if (BytesRead != BytesToRead)
-			{
-				if (!HideCantReadMessage)
-				{
-					ClearProgressInd();
-					fwprintf(stderr, L"File read problem on '%s'.\n", FileName);
-				}
-				return;
-			}
-			fclose(infile);
-
-			CalcCrc(&CheckSum, FileBuffer, BytesRead);
-			free(FileBuffer);
-			CheckSum.Sum += (unsigned int)FileSize;
-			if (PrintFileSigs)
-			{
-				ClearProgressInd();
-				wprintf(L"%08lx%08lx %10llu %s\n", CheckSum.Crc, CheckSum.Sum, FileSize, FileName);
-			}
+			ScanFile(Pending);
 
-			ThisFile.Checksum = CheckSum;
+		if (CheckpointFileName && GetTickCount64() - CkptLastSaveTick >= CHECKPOINT_INTERVAL_MS)
+		{
+			// Quiesce the workers so everything up to here is merged, then
+			// snapshot.  The pipeline bubble costs far less than a percent
+			// at one snapshot per half minute.
+			DrainScanWorkers();
+			ActionQueueDrain(); // The snapshot must not run ahead of pending actions.
+			CheckpointSave(a + 1);
+			CkptLastSaveTick = GetTickCount64();
 		}
 	}
-
-	ThisFile.FileName = _wcsdup(FileName); // allocate the string last, so
-										   // we don't waste memory on errors.
-	CheckDuplicate(ThisFile);
+	DrainScanWorkers();
 }
 
 //--------------------------------------------------------------------------
 // complain about bad state of the command line.
 //--------------------------------------------------------------------------
+//--------------------------------------------------------------------------
+// Print the per-stage breakdown collected for -stats.
+//--------------------------------------------------------------------------
+static double TicksToSecs(ULONGLONG Ticks)
+{
+	static LARGE_INTEGER Freq; // Fixed at boot; query once.
+	if (Freq.QuadPart == 0)
+		QueryPerformanceFrequency(&Freq);
+	return (double)Ticks / (double)Freq.QuadPart;
+}
+
+static void PrintScanStats(void)
+{
+	double CollectSecs = TicksToSecs(ScanStats.CollectTicks);
+	double ScanSecs = TicksToSecs(ScanStats.ScanTicks);
+	double SigMb = ScanStats.SigBytesRead / (1024.0 * 1024.0);
+	double CompareMb = ScanStats.CompareBytes / (1024.0 * 1024.0);
+
+	wprintf(L"\nScan statistics:\n");
+	wprintf(L"  Traversal:    %llu files found in %.2f s (%.0f files/sec)\n",
+		ScanStats.FilesFound, CollectSecs,
+		CollectSecs > 0 ? ScanStats.FilesFound / CollectSecs : 0.0);
+	wprintf(L"  Signatures:   %lld files read, %.1f MB; scan phase took %.2f s (%.1f MB/sec)\n",
+		ScanStats.SigFilesRead, SigMb, ScanSecs,
+		ScanSecs > 0 ? SigMb / ScanSecs : 0.0);
+	if (ScanStats.SigCacheHits || ScanStats.LinkSigHits)
+	{
+		wprintf(L"                %lld signature cache hits, %lld inherited from hardlinks\n",
+			ScanStats.SigCacheHits, ScanStats.LinkSigHits);
+	}
+	wprintf(L"  Index:        %llu lookups, %.2f average probe length\n",
+		ScanStats.IndexLookups,
+		ScanStats.IndexLookups ? (double)ScanStats.IndexProbes / ScanStats.IndexLookups : 0.0);
+	wprintf(L"  Verification: %llu pairs compared, %.1f MB read or mapped\n",
+		ScanStats.ComparePairs, CompareMb);
+	if (ScanStats.FullHashFiles)
+	{
+		wprintf(L"                %llu files full-hashed, %.1f MB\n",
+			ScanStats.FullHashFiles, ScanStats.FullHashBytes / (1024.0 * 1024.0));
+	}
+}
+
 static void Usage(void)
 {
 	wprintf(L"finddupe v"VERSION" compiled "__DATE__"\n");
 	wprintf(L"Usage: finddupe [options] [-ref] <filepat> [filepat]...\n");
+	wprintf(L"       finddupe -apply <planfile>\n");
 	wprintf(L"Options:\n"
 		" -bat <file.bat> Create batch file with commands to do the file\n"
 		"                 operations. Check, modify and run batch file afterwards.\n"
+		" -plan <file>    Like -bat, but write a compact binary plan instead of a\n"
+		"                 batch file.  Needs -hardlink or -del to pick the action.\n"
+		" -apply <file>   Execute a plan written by -plan, revalidating each file\n"
+		"                 by size and file id first.  Much faster than the batch.\n"
+		" -checkpoint <f> Snapshot scan progress to <f> every 30 seconds; an\n"
+		"                 interrupted run resumes where it left off.  Not valid\n"
+		"                 with -bat, -plan, -out or -refindex.\n"
+		" -out <file>     Write each duplicate pair as a tab separated record\n"
+		"                 (action, size, signature, keeper, duplicate) to <file>\n"
+		"                 instead of printing pairs to the console.\n"
 		" -hardlink       Create hardlinks.  Works on NTFS file systems only.\n"
 		"                 Use with caution!\n"
 		" -del            Delete duplicate files.\n"
 		" -v              Verbose output.\n"
-		" -sigs           Show signatures calculated based on first 32k for each file.\n"
+		" -sigs           Show signatures calculated based on first 32k for each file\n"
+		"                 (files of 1MB or more also sample a middle and tail block).\n"
+		" -legacysigs     Use the original signature kernel and head-only sampling\n"
+		"                 instead, for signatures comparable with old -sigs output.\n"
+		" -fullhash       Verify duplicates by a full-file SHA-256 computed once per\n"
+		"                 file, instead of re-comparing the kept file pairwise against\n"
+		"                 every new candidate.  Faster for large duplicate clusters.\n"
 		" -rdonly         Apply to readonly files also (readonly files are skipped by "
 		"                 default).\n"
 		" -ref <filepat>  Following file pattern are files that are for reference, NOT\n"
 		"                 to be eliminated, only used to check duplicates against.\n"
+		" -refindex <f>   If <f> exists, memory map it as the reference set instead\n"
+		"                 of scanning -ref patterns; otherwise write this run's\n"
+		"                 reference records to <f> for later runs to map.\n"
 		" -z              Do not skip zero length files (zero length files are ignored\n"
 		"                 by default).\n"
 		" -u              Do not print a warning for files that cannot be read.\n"
 		" -p              Hide progress indicator (useful when redirecting to a file).\n"
+		" -t <N>          Use N worker threads for checksumming (default 1).\n"
+		" -cache <file>   Load/store file signatures in <file>, so rescans only\n"
+		"                 re-checksum files whose size, mtime or file id changed.\n"
+		" -cachemem <MB>  Keep up to <MB> megabytes of recently verified keeper\n"
+		"                 files in memory, so later duplicates of the same file\n"
+		"                 only read the candidate side from disk.\n"
+		" -stats          Print per-stage counters and timings (traversal rate,\n"
+		"                 signature bytes, index probes, compare I/O) at the end.\n"
 		" -j              Follow NTFS junctions and reparse points (off by default).\n"
+		" -mft            Enumerate whole-volume patterns (like c:\\**) directly from\n"
+		"                 the NTFS master file table instead of walking directories.\n"
+		"                 Needs administrator privileges; falls back to the normal\n"
+		"                 walk if the volume cannot be opened.\n"
 		" -listlink       hardlink list mode.  Not valid with -del, -bat, -hardlink,\n"
 		"                 or -rdonly, options\n"
+		" -clusters       Report verified duplicate groups ranked by reclaimable\n"
+		"                 bytes, without acting on anything.  Not valid with\n"
+		"                 action, -listlink, -out, -checkpoint or reference options.\n"
 		" filepat         Pattern for files.  Examples:\n"
 		"                  c:\\**         Match everything on drive C\n"
 		"                  c:\\**\\*.jpg  Match only .jpg files on drive C\n"
@@ -744,6 +3442,77 @@ int wmain(int argc, WCHAR** argv)
 			PrintDuplicates = false;
 			PrintFileSigs = true;
 		}
+		else if (!wcscmp(arg, L"-legacysigs"))
+		{
+			LegacySigs = true;
+		}
+		else if (!wcscmp(arg, L"-fullhash"))
+		{
+			FullHashMode = true;
+		}
+		else if (!wcscmp(arg, L"-cache"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify cache file name after argument '-cache'.\n");
+				exit(-1);
+			}
+			SigCacheFileName = argv[++argn];
+		}
+		else if (!wcscmp(arg, L"-refindex"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify index file name after argument '-refindex'.\n");
+				exit(-1);
+			}
+			RefIndexFileName = argv[++argn];
+		}
+		else if (!wcscmp(arg, L"-plan"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify plan file name after argument '-plan'.\n");
+				exit(-1);
+			}
+			PlanFileName = argv[++argn];
+		}
+		else if (!wcscmp(arg, L"-apply"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify plan file name after argument '-apply'.\n");
+				exit(-1);
+			}
+			ApplyFileName = argv[++argn];
+		}
+		else if (!wcscmp(arg, L"-checkpoint"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify checkpoint file name after argument '-checkpoint'.\n");
+				exit(-1);
+			}
+			CheckpointFileName = argv[++argn];
+		}
+		else if (!wcscmp(arg, L"-out"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify report file name after argument '-out'.\n");
+				exit(-1);
+			}
+			OutFileName = argv[++argn];
+		}
+		else if (!wcscmp(arg, L"-cachemem"))
+		{
+			int CacheMb;
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify cache size in MB after argument '-cachemem'.\n");
+				exit(-1);
+			}
+			CacheMb = _wtoi(argv[++argn]);
+			if (CacheMb < 1)
+			{
+				wprintf(L"Cache size must be at least 1 MB.\n");
+				exit(-1);
+			}
+			KeeperCacheBudget = (ULONGLONG)CacheMb << 20;
+		}
 		else if (!wcscmp(arg, L"-hardlink"))
 		{
 			MakeHardLinks = true;
@@ -760,6 +3529,10 @@ int wmain(int argc, WCHAR** argv)
 		{
 			HardlinkSearchMode = true;
 		}
+		else if (!wcscmp(arg, L"-clusters"))
+		{
+			ClusterMode = true;
+		}
 		else if (!wcscmp(arg, L"-ref"))
 		{
 			break;
@@ -780,6 +3553,27 @@ int wmain(int argc, WCHAR** argv)
 		{
 			FollowReparse = true;
 		}
+		else if (!wcscmp(arg, L"-mft"))
+		{
+			UseMftScan = true;
+		}
+		else if (!wcscmp(arg, L"-stats"))
+		{
+			ShowStats = true;
+		}
+		else if (!wcscmp(arg, L"-t"))
+		{
+			if (argn + 1 >= argc) {
+				wprintf(L"Please specify thread count after argument '-t'.\n");
+				exit(-1);
+			}
+			ThreadCount = _wtoi(argv[++argn]);
+			if (ThreadCount < 1 || ThreadCount > 256)
+			{
+				wprintf(L"Thread count must be between 1 and 256.\n");
+				exit(-1);
+			}
+		}
 		else
 		{
 			wprintf(L"Argument '%s' not understood.  Use -h for help.\n", arg);
@@ -793,21 +3587,76 @@ int wmain(int argc, WCHAR** argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (ApplyFileName)
+	{
+		// Apply mode executes a previously written plan and does nothing else.
+		if (argn != argc || BatchFileName || MakeHardLinks || DelDuplicates || PlanFileName)
+		{
+			fwprintf(stderr, L"Apply option is not valid with file patterns or other action options.\n");
+			exit(EXIT_FAILURE);
+		}
+		return PlanApply(ApplyFileName);
+	}
+
+	if (PlanFileName)
+	{
+		if (BatchFileName)
+		{
+			fwprintf(stderr, L"Plan option is not valid with the -bat option.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!MakeHardLinks && !DelDuplicates)
+		{
+			fwprintf(stderr, L"Plan option needs -hardlink or -del to choose the action.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (argn == argc)
 	{
 		fwprintf(stderr, L"No files to process.   Use -h for help.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if (CheckpointFileName && (BatchFileName || PlanFileName || OutFileName || RefIndexFileName))
+	{
+		// These modes write their files from scratch each run; a resumed
+		// scan would silently lose the records from before the interruption.
+		fwprintf(stderr, L"Checkpoint option is not valid with -bat, -plan, -out or -refindex.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (HardlinkSearchMode)
 	{
-		if (BatchFileName || MakeHardLinks || DelDuplicates || DoReadonly)
+		if (BatchFileName || MakeHardLinks || DelDuplicates || DoReadonly || RefIndexFileName || OutFileName)
 		{
 			fwprintf(stderr, L"Listlink option is not valid with any other options other than -v.\n");
 			exit(EXIT_FAILURE);
 		}
 	}
 
+	if (ClusterMode)
+	{
+		// The report ranks whole verified groups; pairwise action, report
+		// and reference modes do not apply to it.
+		bool HaveRef = false;
+		int n2;
+		for (n2 = argn; n2 < argc; n2++)
+		{
+			if (!wcscmp(argv[n2], L"-ref"))
+				HaveRef = true;
+		}
+		if (BatchFileName || PlanFileName || MakeHardLinks || DelDuplicates
+			|| HardlinkSearchMode || OutFileName || RefIndexFileName || HaveRef
+			|| CheckpointFileName)
+		{
+			// -checkpoint is also out: its snapshots record normal-mode
+			// chains, which drop confirmed duplicates instead of keeping them.
+			fwprintf(stderr, L"Clusters option is not valid with action, -listlink, -out, -checkpoint or reference options.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	FileData = malloc(sizeof(FileData_t) * NumAllocated);
 	if (FileData == NULL)
 	{
@@ -828,8 +3677,48 @@ int wmain(int argc, WCHAR** argv)
 		fprintf(BatchFile, "REM Created by finddupe program\n\n");
 	}
 
+	if (OutFileName)
+	{
+		_wfopen_s(&OutFile, OutFileName, L"wt, ccs=UTF-8");
+		if (OutFile == NULL)
+		{
+			wprintf(L"Unable to open report file '%s'.\n", OutFileName);
+			exit(EXIT_FAILURE);
+		}
+		// One big user space buffer; records are flushed in megabyte chunks
+		// instead of a write call per pair.
+		setvbuf(OutFile, NULL, _IOFBF, 4 << 20);
+	}
+
+	if (PlanFileName)
+		PlanOpen(PlanFileName, MakeHardLinks);
+
 	memset(&DupeStats, 0, sizeof(DupeStats));
 
+	SelectSignatureKernel();
+	if (SigCacheFileName)
+		SigCacheLoad(SigCacheFileName, CalcSignature == CalcCrc);
+	MyGlobSetThreads(ThreadCount);
+	StartScanWorkers();
+	if ((MakeHardLinks || DelDuplicates) && BatchFileName == NULL && PlanFileName == NULL)
+	{
+		// Actions will be executed directly; run them on the background
+		// executor so they overlap detection.
+		StartActionExecutor();
+	}
+
+	// Map the reference index (if it exists already) before any scanning,
+	// so incoming files are checked against the stored reference records.
+	if (RefIndexFileName)
+		RefIndexLoaded = RefIndexLoad(RefIndexFileName);
+
+	// Read a leftover snapshot now; it is applied (after a fingerprint
+	// check) once the pending list has been rebuilt.
+	if (CheckpointFileName)
+		CheckpointLoad();
+
+	StartProgressReporter();
+
 	{
 		WCHAR CurrentDir[_MAX_PATH];
 #pragma warning(disable:6031)
@@ -837,11 +3726,22 @@ int wmain(int argc, WCHAR** argv)
 		DefaultDrive = towlower(*CurrentDir);
 	}
 
+	LARGE_INTEGER PhaseStart, PhaseEnd;
+	QueryPerformanceCounter(&PhaseStart);
+
+	// Parse the remaining arguments into the pattern list first: slash
+	// normalization, volume assignment and the cross drive hardlink check.
+	PatternList = (PatternEntry_t*)malloc((argc - argn) * sizeof(PatternEntry_t));
+	if (PatternList == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
 	for (; argn < argc; argn++)
 	{
 		size_t a;
 		WCHAR Drive;
-		FilesMatched = 0;
+		CurrentPatternOrdinal += 1;
 
 		if (!wcscmp(argv[argn], L"-ref"))
 		{
@@ -878,23 +3778,100 @@ int wmain(int argc, WCHAR** argv)
 			}
 		}
 
-		// Use my globbing module to do fancier wildcard expansion with recursive
-		// subdirectories under Windows.
-		MyGlob(argv[argn], FollowReparse, ProcessFile);
+		if (RefIndexLoaded && ReferenceFiles)
+			continue; // The reference records already came from the mapped index.
 
-		if (FilesMatched == 0)
+		PatternList[NumPatterns].Pattern = argv[argn];
+		PatternList[NumPatterns].Drive = Drive;
+		PatternList[NumPatterns].IsReference = ReferenceFiles;
+		PatternList[NumPatterns].Ordinal = CurrentPatternOrdinal;
+		PatternList[NumPatterns].Matched = 0;
+		NumPatterns += 1;
+	}
+
+	{
+		// Patterns on distinct volumes have no ordering dependency between
+		// them, so scan each volume on its own thread.  The pending list is
+		// sorted back to the sequential order before phase two, so results
+		// do not depend on which volume finishes first.
+		WCHAR Drives[26]; // At most one entry per drive letter.
+		size_t NumDrives = 0, a, b;
+
+		for (a = 0; a < NumPatterns; a++)
 		{
-			fwprintf(stderr, L"Error: No files matched '%s'.\n", argv[argn]);
-			return EXIT_FAILURE;
+			for (b = 0; b < NumDrives; b++)
+			{
+				if (Drives[b] == PatternList[a].Drive)
+					break;
+			}
+			if (b == NumDrives && NumDrives < 26)
+				Drives[NumDrives++] = PatternList[a].Drive;
+		}
+
+		if (ThreadCount > 1 && NumDrives > 1)
+		{
+			HANDLE VolumeThreads[26];
+			PerVolumeActive = true;
+			MyGlobSetThreads(1); // Volume threads traverse sequentially; the subtree pool is not reentrant.
+			for (a = 0; a < NumDrives; a++)
+			{
+				VolumeThreads[a] = (HANDLE)_beginthreadex(NULL, 0, VolumeScanThread,
+					(void*)(ULONG_PTR)Drives[a], 0, NULL);
+				if (VolumeThreads[a] == NULL)
+				{
+					fwprintf(stderr, L"Thread creation failure.\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			for (a = 0; a < NumDrives; a++)
+			{
+				WaitForSingleObject(VolumeThreads[a], INFINITE);
+				CloseHandle(VolumeThreads[a]);
+			}
+			for (a = 0; a < NumPatterns; a++)
+			{
+				if (PatternList[a].Matched == 0)
+				{
+					fwprintf(stderr, L"Error: No files matched '%s'.\n", PatternList[a].Pattern);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+		else
+		{
+			for (a = 0; a < NumPatterns; a++)
+			{
+				FilesMatched = 0;
+				ReferenceFiles = PatternList[a].IsReference;
+				CurrentPatternOrdinal = PatternList[a].Ordinal;
+				RunPattern(&PatternList[a]);
+				if (FilesMatched == 0)
+				{
+					fwprintf(stderr, L"Error: No files matched '%s'.\n", PatternList[a].Pattern);
+					return EXIT_FAILURE;
+				}
+			}
 		}
 	}
 
+	QueryPerformanceCounter(&PhaseEnd);
+	ScanStats.CollectTicks = PhaseEnd.QuadPart - PhaseStart.QuadPart;
+	PhaseStart = PhaseEnd;
+
+	ProcessPendingFiles();
+	StopScanWorkers();
+	StopActionExecutor(); // Finishes any still-queued -hardlink / -del actions.
+	StopProgressReporter();
+
+	QueryPerformanceCounter(&PhaseEnd);
+	ScanStats.ScanTicks = PhaseEnd.QuadPart - PhaseStart.QuadPart;
+
 	if (HardlinkSearchMode)
 	{
 		ClearProgressInd();
 		wprintf(L"\n");
 		DupeStats.HardlinkGroups = 0;
-		ShowLinkGroups(1);
+		ShowLinkGroups();
 		wprintf(L"\nNumber of hardlink groups found: %llu.\n", DupeStats.HardlinkGroups);
 	}
 	else
@@ -911,6 +3888,13 @@ int wmain(int argc, WCHAR** argv)
 			BatchFile = NULL;
 		}
 
+		if (ClusterMode)
+		{
+			// Resolve the deferred chains and print the ranked report; this
+			// also fills in the duplicate counts the summary prints below.
+			ShowClusters();
+		}
+
 		// Print summary data
 		ClearProgressInd();
 		wprintf(L"\n");
@@ -926,5 +3910,32 @@ int wmain(int argc, WCHAR** argv)
 		wprintf(L"  %llu files could not be opened\n", DupeStats.CantReadFiles);
 	}
 
+	if (CheckpointFileName)
+		DeleteFileW(CheckpointFileName); // Scan completed; the snapshot is spent.
+
+	if (RefIndexFileName && !RefIndexLoaded)
+		RefIndexSave(RefIndexFileName);
+
+	if (OutFile)
+	{
+		fclose(OutFile);
+		OutFile = NULL;
+	}
+
+	if (PlanFileName)
+		PlanClose();
+
+	if (ShowStats)
+		PrintScanStats();
+
+	if (SigCacheFileName)
+		SigCacheSave(SigCacheFileName, CalcSignature == CalcCrc);
+
+	if (ActionFailed)
+	{
+		fwprintf(stderr, L"One or more delete/hardlink actions failed; remaining actions were skipped.\n");
+		return EXIT_FAILURE;
+	}
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,293 @@
+//--------------------------------------------------------------------------------
+// Whole-volume file enumeration straight from the NTFS MFT via
+// FSCTL_ENUM_USN_DATA, used by the -mft option for patterns like c:\**.
+//
+// Instead of opening every directory through _wfindfirst64, the volume's
+// master file table is streamed in megabyte batches.  Each record carries
+// the file name and the parent file reference number, so full paths are
+// reconstructed afterwards from an in-memory table and handed to the same
+// per-file callback the glob walker uses.  Needs a volume handle, which
+// requires administrator privileges; the caller falls back to the normal
+// walker when that (or the FSCTL itself) fails.
+//
+// ElemenTP 2022
+//--------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#define WIN32_LEAN_AND_MEAN // To keep windows.h bloat down.
+#define _WIN32_WINNT 0x0600
+#include <windows.h>
+#include <winioctl.h>
+
+// One MFT record we care about: where it hangs and what it is called.
+typedef struct
+{
+	ULONGLONG Frn;       // File reference number.
+	ULONGLONG ParentFrn;
+	WCHAR* Name;
+	bool IsDir;
+} MftEntry_t;
+
+static MftEntry_t* MftEntries;
+static size_t NumMftEntries, MftEntriesAllocated;
+
+// Name storage - same slab scheme as the scan path arena.
+typedef struct MftSlab
+{
+	struct MftSlab* Next;
+	size_t Used;
+	size_t Capacity;
+} MftSlab_t;
+#define MFT_SLAB_CHARS (1 << 19)
+static MftSlab_t* MftSlabs;
+
+// FRN -> entry index hash (open addressing, index 0 reserved as empty
+// by storing index + 1).
+static size_t* FrnIndex;
+static size_t FrnIndexSize;
+
+//--------------------------------------------------------------------------------
+// Copy a counted name into the slab arena.
+//--------------------------------------------------------------------------------
+static WCHAR* MftDupName(const WCHAR* Name, size_t Chars)
+{
+	WCHAR* Out;
+	if (MftSlabs == NULL || MftSlabs->Used + Chars + 1 > MftSlabs->Capacity)
+	{
+		size_t AllocChars = Chars + 1 > MFT_SLAB_CHARS ? Chars + 1 : MFT_SLAB_CHARS;
+		MftSlab_t* Slab = (MftSlab_t*)malloc(sizeof(MftSlab_t) + AllocChars * sizeof(WCHAR));
+		if (Slab == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		Slab->Next = MftSlabs;
+		Slab->Used = 0;
+		Slab->Capacity = AllocChars;
+		MftSlabs = Slab;
+	}
+	Out = (WCHAR*)(MftSlabs + 1) + MftSlabs->Used;
+	memcpy(Out, Name, Chars * sizeof(WCHAR));
+	Out[Chars] = L'\0';
+	MftSlabs->Used += Chars + 1;
+	return Out;
+}
+
+//--------------------------------------------------------------------------------
+// Release everything the enumeration built.
+//--------------------------------------------------------------------------------
+static void MftFreeAll(void)
+{
+	MftSlab_t* Slab = MftSlabs;
+	while (Slab)
+	{
+		MftSlab_t* Next = Slab->Next;
+		free(Slab);
+		Slab = Next;
+	}
+	MftSlabs = NULL;
+	free(MftEntries);
+	MftEntries = NULL;
+	NumMftEntries = MftEntriesAllocated = 0;
+	free(FrnIndex);
+	FrnIndex = NULL;
+	FrnIndexSize = 0;
+}
+
+//--------------------------------------------------------------------------------
+// Build the FRN lookup table once all records are in.
+//--------------------------------------------------------------------------------
+static void BuildFrnIndex(void)
+{
+	size_t a, Slot;
+	FrnIndexSize = 64;
+	while (FrnIndexSize < NumMftEntries * 2)
+		FrnIndexSize *= 2;
+	FrnIndex = (size_t*)calloc(FrnIndexSize, sizeof(size_t));
+	if (FrnIndex == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (a = 0; a < NumMftEntries; a++)
+	{
+		Slot = (size_t)((MftEntries[a].Frn * 0x9E3779B97F4A7C15ull) & (FrnIndexSize - 1));
+		while (FrnIndex[Slot])
+			Slot = (Slot + 1) & (FrnIndexSize - 1);
+		FrnIndex[Slot] = a + 1;
+	}
+}
+
+//--------------------------------------------------------------------------------
+// Look up an entry by file reference number; (size_t)-1 if not present.
+//--------------------------------------------------------------------------------
+static size_t LookupFrn(ULONGLONG Frn)
+{
+	size_t Slot = (size_t)((Frn * 0x9E3779B97F4A7C15ull) & (FrnIndexSize - 1));
+	while (FrnIndex[Slot])
+	{
+		if (MftEntries[FrnIndex[Slot] - 1].Frn == Frn)
+			return FrnIndex[Slot] - 1;
+		Slot = (Slot + 1) & (FrnIndexSize - 1);
+	}
+	return (size_t)-1;
+}
+
+//--------------------------------------------------------------------------------
+// Reconstruct the full path of an entry by walking the parent chain.
+// Returns false if the path does not fit or the chain is broken.
+//--------------------------------------------------------------------------------
+static bool BuildMftPath(WCHAR Drive, size_t index, WCHAR* Path, size_t PathChars)
+{
+	// Collect the chain bottom-up, then emit top-down.
+	size_t Chain[128], ChainLen = 0, a, Out = 0, l;
+
+	for (;;)
+	{
+		if (ChainLen >= 128)
+			return false; // Impossibly deep; corrupt chain.
+		Chain[ChainLen++] = index;
+		index = LookupFrn(MftEntries[index].ParentFrn);
+		if (index == (size_t)-1)
+			break; // Reached the root (the root itself has no record).
+	}
+
+	if (PathChars < 4)
+		return false;
+	Path[Out++] = Drive;
+	Path[Out++] = L':';
+	for (a = ChainLen; a > 0; a--)
+	{
+		l = wcslen(MftEntries[Chain[a - 1]].Name);
+		if (Out + l + 2 > PathChars)
+			return false;
+		Path[Out++] = L'\\';
+		memcpy(Path + Out, MftEntries[Chain[a - 1]].Name, l * sizeof(WCHAR));
+		Out += l;
+	}
+	Path[Out] = L'\0';
+	return true;
+}
+
+//--------------------------------------------------------------------------------
+// Enumerate every file on the given drive from the MFT and hand the
+// reconstructed paths to the callback.  Returns 0 on success, nonzero
+// if the volume could not be enumerated (caller should fall back).
+//--------------------------------------------------------------------------------
+int MyMftEnum(WCHAR Drive, void (*FileFuncParm)(const WCHAR* FileName))
+{
+	HANDLE Volume;
+	WCHAR VolumeName[8] = L"\\\\.\\C:";
+	MFT_ENUM_DATA_V0 EnumData;
+	BYTE* Buffer;
+	DWORD BytesReturned;
+	size_t a;
+	int Result = 1;
+
+#define MFT_ENUM_BUF_SIZE (1 << 20)
+
+	VolumeName[4] = Drive;
+	Volume = CreateFileW(VolumeName,
+		GENERIC_READ,                       // dwDesiredAccess
+		FILE_SHARE_READ | FILE_SHARE_WRITE, // dwShareMode
+		NULL,                               // Security attirbutes
+		OPEN_EXISTING,                      // dwCreationDisposition
+		0,                                  // dwFlagsAndAttributes
+		NULL);                              // hTemplateFile
+	if (Volume == INVALID_HANDLE_VALUE)
+	{
+		fwprintf(stderr, L"Could not open volume %c: for MFT enumeration (administrator privileges needed).\n", Drive);
+		return 1;
+	}
+
+	Buffer = (BYTE*)malloc(MFT_ENUM_BUF_SIZE);
+	if (Buffer == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&EnumData, 0, sizeof(EnumData));
+	EnumData.StartFileReferenceNumber = 0;
+	EnumData.LowUsn = 0;
+	EnumData.HighUsn = MAXLONGLONG;
+
+	for (;;)
+	{
+		if (!DeviceIoControl(Volume, FSCTL_ENUM_USN_DATA, &EnumData, sizeof(EnumData),
+			Buffer, MFT_ENUM_BUF_SIZE, &BytesReturned, NULL))
+		{
+			if (GetLastError() == ERROR_HANDLE_EOF)
+			{
+				Result = 0;
+				break;
+			}
+			fwprintf(stderr, L"MFT enumeration of %c: failed (not NTFS?).\n", Drive);
+			break;
+		}
+		if (BytesReturned < sizeof(USN))
+			break;
+
+		// First 8 bytes are the continuation FRN, then packed USN records.
+		EnumData.StartFileReferenceNumber = *(ULONGLONG*)Buffer;
+		{
+			BYTE* p = Buffer + sizeof(ULONGLONG);
+			BYTE* End = Buffer + BytesReturned;
+			while (p < End)
+			{
+				USN_RECORD* Record = (USN_RECORD*)p;
+				if (Record->RecordLength == 0)
+					break;
+
+				if (NumMftEntries >= MftEntriesAllocated)
+				{
+					MftEntriesAllocated = MftEntriesAllocated ? MftEntriesAllocated + MftEntriesAllocated / 2 : 65536;
+#pragma warning(disable:6308)
+					MftEntries = (MftEntry_t*)realloc(MftEntries, MftEntriesAllocated * sizeof(MftEntry_t));
+					if (MftEntries == NULL)
+					{
+						fwprintf(stderr, L"Malloc failure.\n");
+						exit(EXIT_FAILURE);
+					}
+				}
+				MftEntries[NumMftEntries].Frn = Record->FileReferenceNumber;
+				MftEntries[NumMftEntries].ParentFrn = Record->ParentFileReferenceNumber;
+				MftEntries[NumMftEntries].IsDir = (Record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+				MftEntries[NumMftEntries].Name = MftDupName(
+					(WCHAR*)(p + Record->FileNameOffset), Record->FileNameLength / sizeof(WCHAR));
+				NumMftEntries += 1;
+
+				p += Record->RecordLength;
+			}
+		}
+	}
+
+	free(Buffer);
+	CloseHandle(Volume);
+
+	if (Result != 0)
+	{
+		MftFreeAll();
+		return Result;
+	}
+
+	BuildFrnIndex();
+
+	for (a = 0; a < NumMftEntries; a++)
+	{
+		WCHAR Path[_MAX_PATH * 2];
+		if (MftEntries[a].IsDir)
+			continue;
+		if (MftEntries[a].Name[0] == L'$' && LookupFrn(MftEntries[a].ParentFrn) == (size_t)-1)
+			continue; // NTFS metadata files at the root ($MFT, $Secure, ...).
+		if (BuildMftPath(Drive, a, Path, _MAX_PATH * 2))
+		{
+			FileFuncParm(Path);
+		}
+	}
+
+	MftFreeAll();
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <io.h>
+#include <process.h>
 #include <sys/stat.h>
 #include <stdbool.h>
 #define WIN32_LEAN_AND_MEAN // To keep windows.h bloat down.
@@ -25,10 +26,34 @@
 
 typedef struct
 {
-	WCHAR* Name;
+	size_t NameOff; // WCHARs into the thread's name pool.
 	unsigned int attrib;
 } FileEntry;
 
+// Parallel traversal state.  When more than one traversal thread is
+// configured, Recurse pushes the patterns for subdirectories it finds
+// onto this shared LIFO stack instead of recursing, and a pool of
+// threads pops and expands them, so independent subtrees enumerate
+// concurrently.  The per-file callback must then be thread safe.
+static int GlobThreads = 1;
+static bool GlobParallelActive;
+static WCHAR** DirStack;
+static size_t DirStackCount, DirStackAlloc;
+static int GlobBusy;
+static CRITICAL_SECTION GlobLock;
+static CONDITION_VARIABLE GlobWork;
+static bool GlobLockInited;
+static bool GlobFollowReparse;
+static void (*GlobFileFunc)(const WCHAR* FileName);
+
+//--------------------------------------------------------------------------------
+// Set how many threads MyGlob may use for directory traversal.
+//--------------------------------------------------------------------------------
+void MyGlobSetThreads(int NumThreads)
+{
+	GlobThreads = NumThreads > 1 ? NumThreads : 1;
+}
+
 #ifdef DEBUGGING
 //--------------------------------------------------------------------------------
 // Dummy function to show operation.
@@ -67,12 +92,78 @@ static bool CatPath(WCHAR* dest, const WCHAR* p1, const WCHAR* p2)
 	return true;
 }
 
+// Per-thread pools for directory listings.  Recurse used to build every
+// directory's list with a realloc growth loop, one malloc per name and a
+// free pass afterwards - repeated for millions of directories, allocator
+// time rivaled the actual I/O.  Each traversal thread instead keeps one
+// entry array, one name buffer and one sort-index array, used like
+// stacks: a directory level remembers the pool marks on entry and
+// rewinds to them when it is done, so deeper levels reuse the same
+// memory over and over.  Entries refer to their names by offset, so
+// growing a pool with realloc cannot dangle anything.
+static __declspec(thread) FileEntry* EntryPool;
+static __declspec(thread) size_t EntryPoolUsed, EntryPoolAlloc;
+static __declspec(thread) WCHAR* NamePool;
+static __declspec(thread) size_t NamePoolUsed, NamePoolAlloc;
+static __declspec(thread) size_t* IndexPool;
+static __declspec(thread) size_t IndexPoolUsed, IndexPoolAlloc;
+
+//--------------------------------------------------------------------------------
+// Append one directory entry to the calling thread's pools.
+//--------------------------------------------------------------------------------
+static void PoolAddEntry(const WCHAR* Name, unsigned int attrib)
+{
+	size_t Chars = wcslen(Name) + 1;
+
+	if (EntryPoolUsed >= EntryPoolAlloc)
+	{
+		EntryPoolAlloc = EntryPoolAlloc + 256 + EntryPoolAlloc / 2;
+#pragma warning(disable:6308)
+		EntryPool = (FileEntry*)realloc(EntryPool, EntryPoolAlloc * sizeof(FileEntry));
+	}
+	if (NamePoolUsed + Chars > NamePoolAlloc)
+	{
+		NamePoolAlloc = NamePoolAlloc + (1 << 16) + NamePoolAlloc / 2;
+#pragma warning(disable:6308)
+		NamePool = (WCHAR*)realloc(NamePool, NamePoolAlloc * sizeof(WCHAR));
+	}
+	if (EntryPool == NULL || NamePool == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(NamePool + NamePoolUsed, Name, Chars * sizeof(WCHAR));
+	EntryPool[EntryPoolUsed].NameOff = NamePoolUsed;
+	EntryPool[EntryPoolUsed].attrib = attrib;
+	NamePoolUsed += Chars;
+	EntryPoolUsed += 1;
+}
+
+//--------------------------------------------------------------------------------
+// Qsort compare function: sorts entry indices by name, so only 8-byte
+// indices move instead of the entries themselves.
+//--------------------------------------------------------------------------------
+static int CompareEntryIndex(const void* p1, const void* p2)
+{
+	return wcscmp(NamePool + EntryPool[*(const size_t*)p1].NameOff,
+		NamePool + EntryPool[*(const size_t*)p2].NameOff);
+}
+
 //--------------------------------------------------------------------------------
-// Qsort compare function
+// Release the calling thread's pools.  Called when a traversal thread is
+// about to exit; the main thread keeps its pools for the next pattern.
 //--------------------------------------------------------------------------------
-int CompareFunc(const void* f1, const void* f2)
+static void PoolFreeThread(void)
 {
-	return wcscmp(((FileEntry*)f1)->Name, ((FileEntry*)f2)->Name);
+	free(EntryPool);
+	free(NamePool);
+	free(IndexPool);
+	EntryPool = NULL;
+	NamePool = NULL;
+	IndexPool = NULL;
+	EntryPoolUsed = EntryPoolAlloc = 0;
+	NamePoolUsed = NamePoolAlloc = 0;
+	IndexPoolUsed = IndexPoolAlloc = 0;
 }
 
 //--------------------------------------------------------------------------------
@@ -114,6 +205,37 @@ bool IsReparsePoint(WCHAR* DirName)
 	}
 }
 
+//--------------------------------------------------------------------------------
+// Queue a subdirectory pattern for the traversal thread pool.
+//--------------------------------------------------------------------------------
+static void GlobPush(const WCHAR* Pattern)
+{
+	size_t l = wcslen(Pattern) + 1;
+	WCHAR* Copy = malloc(l * sizeof(WCHAR));
+	if (Copy == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(Copy, Pattern, l * sizeof(WCHAR));
+
+	EnterCriticalSection(&GlobLock);
+	if (DirStackCount >= DirStackAlloc)
+	{
+		DirStackAlloc = DirStackAlloc + 64 + DirStackAlloc / 2;
+#pragma warning(disable:6308)
+		DirStack = (WCHAR**)realloc(DirStack, DirStackAlloc * sizeof(WCHAR*));
+		if (DirStack == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	DirStack[DirStackCount++] = Copy;
+	LeaveCriticalSection(&GlobLock);
+	WakeConditionVariable(&GlobWork);
+}
+
 //--------------------------------------------------------------------------------
 // Decide how a particular pattern should be handled, and call function for each.
 //--------------------------------------------------------------------------------
@@ -197,8 +319,11 @@ DoExtraLevel:
 #endif
 
 	{
-		FileEntry* FileList = NULL;
-		size_t NumAllocated = 0, NumHave = 0;
+		// Pool marks for this directory level; rewound when the level is done.
+		size_t EntryBase = EntryPoolUsed;
+		size_t NameBase = NamePoolUsed;
+		size_t IndexBase = IndexPoolUsed;
+		size_t NumHave;
 
 		struct _wfinddatai64_t finddata;
 		long long find_handle;
@@ -227,26 +352,7 @@ DoExtraLevel:
 					goto next_file;
 			}
 
-			// Add it to the list.
-			if (NumAllocated <= NumHave)
-			{
-				NumAllocated = NumAllocated + 10 + NumAllocated / 2;
-#pragma warning(disable:6308)
-				FileList = (FileEntry*)realloc(FileList, NumAllocated * sizeof(FileEntry));
-				if (FileList == NULL)
-					goto nomem;
-			}
-			a = wcslen(finddata.name);
-			FileList[NumHave].Name = malloc((a + 1) * sizeof(WCHAR));
-			if (FileList[NumHave].Name == NULL)
-			{
-			nomem:
-				fwprintf(stderr, L"Malloc failure.\n");
-				exit(EXIT_FAILURE);
-			}
-			memcpy(FileList[NumHave].Name, finddata.name, (a + 1) * sizeof(WCHAR));
-			FileList[NumHave].attrib = finddata.attrib;
-			NumHave++;
+			PoolAddEntry(finddata.name, finddata.attrib);
 
 		next_file:
 			if (_wfindnext64(find_handle, &finddata) != 0)
@@ -254,34 +360,61 @@ DoExtraLevel:
 		}
 		_findclose(find_handle);
 
-		// Sort the list...
-		qsort(FileList, NumHave, sizeof(FileEntry), CompareFunc);
+		NumHave = EntryPoolUsed - EntryBase;
+
+		// Sort an index over the pool instead of moving the entries.
+		if (IndexPoolUsed + NumHave > IndexPoolAlloc)
+		{
+			IndexPoolAlloc = IndexPoolAlloc + NumHave + 256 + IndexPoolAlloc / 2;
+#pragma warning(disable:6308)
+			IndexPool = (size_t*)realloc(IndexPool, IndexPoolAlloc * sizeof(size_t));
+			if (IndexPool == NULL)
+			{
+				fwprintf(stderr, L"Malloc failure.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (a = 0; a < NumHave; a++)
+			IndexPool[IndexBase + a] = EntryBase + a;
+		IndexPoolUsed += NumHave;
+		qsort(IndexPool + IndexBase, NumHave, sizeof(size_t), CompareEntryIndex);
 
-		// Use the list.
+		// Use the list.  Deeper levels grow the pools above our marks and
+		// may move them with realloc, so always go through the pool
+		// pointers afresh rather than caching anything across a recursion.
 		for (a = 0; a < NumHave; a++)
 		{
 			WCHAR CombinedName[_MAX_PATH * 2];
-			if (FileList[a].attrib & _A_SUBDIR)
+			size_t e = IndexPool[IndexBase + a];
+			unsigned int attrib = EntryPool[e].attrib;
+
+			if (attrib & _A_SUBDIR)
 			{
-				if (CatPath(CombinedName, BasePattern, FileList[a].Name))
+				if (CatPath(CombinedName, BasePattern, NamePool + EntryPool[e].NameOff))
 				{
 					if (FollowReparse || !IsReparsePoint(CombinedName))
 					{
 						wcscat_s(CombinedName, _MAX_PATH * 2, PatCopy + PatternEnd);
-						Recurse(CombinedName, FollowReparse, FileFuncParm);
+						if (GlobParallelActive)
+							GlobPush(CombinedName);
+						else
+							Recurse(CombinedName, FollowReparse, FileFuncParm);
 					}
 				}
 			}
 			else
 			{
-				if (CatPath(CombinedName, BasePattern, FileList[a].Name))
+				if (CatPath(CombinedName, BasePattern, NamePool + EntryPool[e].NameOff))
 				{
 					FileFuncParm(CombinedName);
 				}
 			}
-			free(FileList[a].Name);
 		}
-		free(FileList);
+
+		// This level's entries are dead; give the space back to the pools.
+		EntryPoolUsed = EntryBase;
+		NamePoolUsed = NameBase;
+		IndexPoolUsed = IndexBase;
 	}
 
 	if (HasSSA)
@@ -301,6 +434,84 @@ DoExtraLevel:
 	}
 }
 
+//--------------------------------------------------------------------------------
+// Traversal pool thread.  Pops directory patterns (most recently found
+// first, for locality) and expands them; exits when the stack is empty
+// and no other thread is still expanding one.
+//--------------------------------------------------------------------------------
+static unsigned __stdcall GlobWorker(void* arg)
+{
+	(void)arg;
+	for (;;)
+	{
+		WCHAR* Pattern;
+		EnterCriticalSection(&GlobLock);
+		while (DirStackCount == 0 && GlobBusy != 0)
+		{
+			SleepConditionVariableCS(&GlobWork, &GlobLock, INFINITE);
+		}
+		if (DirStackCount == 0)
+		{
+			// Nothing queued and nobody working; traversal is complete.
+			LeaveCriticalSection(&GlobLock);
+			WakeAllConditionVariable(&GlobWork);
+			break;
+		}
+		Pattern = DirStack[--DirStackCount];
+		GlobBusy += 1;
+		LeaveCriticalSection(&GlobLock);
+
+		Recurse(Pattern, GlobFollowReparse, GlobFileFunc);
+		free(Pattern);
+
+		EnterCriticalSection(&GlobLock);
+		GlobBusy -= 1;
+		if (GlobBusy == 0 && DirStackCount == 0)
+			WakeAllConditionVariable(&GlobWork);
+		LeaveCriticalSection(&GlobLock);
+	}
+	PoolFreeThread();
+	return 0;
+}
+
+//--------------------------------------------------------------------------------
+// Expand one pattern with the traversal thread pool.
+//--------------------------------------------------------------------------------
+static void RecurseParallel(const WCHAR* Pattern, bool FollowReparse, void (*FileFuncParm)(const WCHAR* FileName))
+{
+	HANDLE Threads[256];
+	int a, NumThreads = GlobThreads;
+
+	if (!GlobLockInited)
+	{
+		InitializeCriticalSection(&GlobLock);
+		InitializeConditionVariable(&GlobWork);
+		GlobLockInited = true;
+	}
+	if (NumThreads > 256)
+		NumThreads = 256;
+	GlobFollowReparse = FollowReparse;
+	GlobFileFunc = FileFuncParm;
+	GlobParallelActive = true;
+	GlobPush(Pattern);
+
+	for (a = 0; a < NumThreads; a++)
+	{
+		Threads[a] = (HANDLE)_beginthreadex(NULL, 0, GlobWorker, NULL, 0, NULL);
+		if (Threads[a] == 0)
+		{
+			fwprintf(stderr, L"Could not start traversal thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (a = 0; a < NumThreads; a++)
+	{
+		WaitForSingleObject(Threads[a], INFINITE);
+		CloseHandle(Threads[a]);
+	}
+	GlobParallelActive = false;
+}
+
 //--------------------------------------------------------------------------------
 // Do quick precheck - if no wildcards, and it names a directory, do whole dir.
 //--------------------------------------------------------------------------------
@@ -342,7 +553,10 @@ int MyGlob(const WCHAR* Pattern, bool FollowReparse, void (*FileFuncParm)(const
 		{
 			if (CatPath(PathCopy, PathCopy, L"**"))
 			{
-				Recurse(PathCopy, FollowReparse, FileFuncParm);
+				if (GlobThreads > 1)
+					RecurseParallel(PathCopy, FollowReparse, FileFuncParm);
+				else
+					Recurse(PathCopy, FollowReparse, FileFuncParm);
 			}
 		}
 		else
@@ -353,7 +567,10 @@ int MyGlob(const WCHAR* Pattern, bool FollowReparse, void (*FileFuncParm)(const
 	else
 	{
 		// A wildcard was specified.
-		Recurse(PathCopy, FollowReparse, FileFuncParm);
+		if (GlobThreads > 1)
+			RecurseParallel(PathCopy, FollowReparse, FileFuncParm);
+		else
+			Recurse(PathCopy, FollowReparse, FileFuncParm);
 	}
 	return 0;
 }
@@ -0,0 +1,259 @@
+//--------------------------------------------------------------------------------
+// On-disk signature cache so rescans of a mostly unchanged tree do not redo
+// the 32k checksum read for every file.
+//
+// The cache is a flat binary file mapping (path, size, mtime, FileIndex) to
+// the signature computed last time.  It is loaded into a hash table keyed on
+// the path at startup, consulted before each signature read, and written back
+// at exit.  A header flag records which signature kernel produced the
+// entries, so a cache written with the hardware kernel is not trusted by a
+// -legacysigs run (and vice versa).
+//
+// ElemenTP 2022
+//--------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#define WIN32_LEAN_AND_MEAN // To keep windows.h bloat down.
+#define _WIN32_WINNT 0x0600
+#include <windows.h>
+
+#define SIGCACHE_MAGIC "FDSC"
+#define SIGCACHE_VERSION 2 // v2: large files add middle and tail sample blocks.
+
+typedef struct
+{
+	ULONGLONG FileSize;
+	__time64_t Mtime;
+	DWORD IndexHigh;
+	DWORD IndexLow;
+	unsigned int Crc;
+	unsigned int Sum;
+	WCHAR* Path; // NULL means empty slot.
+} CacheEntry_t;
+
+static CacheEntry_t* CacheTable;
+static size_t CacheTableSize; // Always a power of two.
+static size_t CacheEntries;
+static CRITICAL_SECTION CacheLock;
+static bool CacheLockInited;
+
+//--------------------------------------------------------------------------------
+// FNV-1a hash over the path characters.
+//--------------------------------------------------------------------------------
+static ULONGLONG HashPath(const WCHAR* Path)
+{
+	ULONGLONG Hash = 14695981039346656037ull;
+	while (*Path)
+	{
+		Hash = (Hash ^ (ULONGLONG)*Path++) * 1099511628211ull;
+	}
+	return Hash;
+}
+
+//--------------------------------------------------------------------------------
+// Find the slot for a path - either its entry or the empty slot to put it in.
+//--------------------------------------------------------------------------------
+static CacheEntry_t* FindSlot(const WCHAR* Path)
+{
+	size_t Slot = (size_t)(HashPath(Path) & (CacheTableSize - 1));
+	for (;;)
+	{
+		if (CacheTable[Slot].Path == NULL)
+			return &CacheTable[Slot];
+		if (wcscmp(CacheTable[Slot].Path, Path) == 0)
+			return &CacheTable[Slot];
+		Slot = (Slot + 1) & (CacheTableSize - 1);
+	}
+}
+
+//--------------------------------------------------------------------------------
+// Grow the table when it gets past two thirds full.
+//--------------------------------------------------------------------------------
+static void GrowTable(void)
+{
+	CacheEntry_t* OldTable = CacheTable;
+	size_t OldSize = CacheTableSize, a;
+
+	CacheTableSize = OldSize ? OldSize * 2 : 4096;
+	CacheTable = (CacheEntry_t*)calloc(CacheTableSize, sizeof(CacheEntry_t));
+	if (CacheTable == NULL)
+	{
+		fwprintf(stderr, L"Malloc failure.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (a = 0; a < OldSize; a++)
+	{
+		if (OldTable[a].Path)
+			*FindSlot(OldTable[a].Path) = OldTable[a];
+	}
+	free(OldTable);
+}
+
+//--------------------------------------------------------------------------------
+// Insert or refresh one entry.  Caller holds the lock.
+//--------------------------------------------------------------------------------
+static void StoreLocked(const WCHAR* Path, ULONGLONG FileSize, __time64_t Mtime,
+	DWORD IndexHigh, DWORD IndexLow, unsigned int Crc, unsigned int Sum)
+{
+	CacheEntry_t* Entry;
+	if (CacheEntries * 3 >= CacheTableSize * 2)
+		GrowTable();
+	Entry = FindSlot(Path);
+	if (Entry->Path == NULL)
+	{
+		Entry->Path = _wcsdup(Path);
+		if (Entry->Path == NULL)
+		{
+			fwprintf(stderr, L"Malloc failure.\n");
+			exit(EXIT_FAILURE);
+		}
+		CacheEntries += 1;
+	}
+	Entry->FileSize = FileSize;
+	Entry->Mtime = Mtime;
+	Entry->IndexHigh = IndexHigh;
+	Entry->IndexLow = IndexLow;
+	Entry->Crc = Crc;
+	Entry->Sum = Sum;
+}
+
+//--------------------------------------------------------------------------------
+// Look up a file.  Hit only if size, mtime and FileIndex all still match.
+//--------------------------------------------------------------------------------
+bool SigCacheLookup(const WCHAR* Path, ULONGLONG FileSize, __time64_t Mtime,
+	DWORD IndexHigh, DWORD IndexLow, unsigned int* Crc, unsigned int* Sum)
+{
+	CacheEntry_t* Entry;
+	bool Hit = false;
+	if (CacheTableSize == 0)
+		return false;
+	EnterCriticalSection(&CacheLock);
+	Entry = FindSlot(Path);
+	if (Entry->Path != NULL
+		&& Entry->FileSize == FileSize && Entry->Mtime == Mtime
+		&& Entry->IndexHigh == IndexHigh && Entry->IndexLow == IndexLow)
+	{
+		*Crc = Entry->Crc;
+		*Sum = Entry->Sum;
+		Hit = true;
+	}
+	LeaveCriticalSection(&CacheLock);
+	return Hit;
+}
+
+//--------------------------------------------------------------------------------
+// Record a freshly computed signature.
+//--------------------------------------------------------------------------------
+void SigCacheStore(const WCHAR* Path, ULONGLONG FileSize, __time64_t Mtime,
+	DWORD IndexHigh, DWORD IndexLow, unsigned int Crc, unsigned int Sum)
+{
+	EnterCriticalSection(&CacheLock);
+	StoreLocked(Path, FileSize, Mtime, IndexHigh, IndexLow, Crc, Sum);
+	LeaveCriticalSection(&CacheLock);
+}
+
+//--------------------------------------------------------------------------------
+// Load the cache file.  A missing file is fine (first run); a file written
+// by a different kernel or format version is silently ignored.
+//--------------------------------------------------------------------------------
+void SigCacheLoad(const WCHAR* CacheFileName, bool LegacyKernel)
+{
+	FILE* File = NULL;
+	char Magic[4];
+	unsigned int Version, Flags;
+	ULONGLONG Count, a;
+
+	if (!CacheLockInited)
+	{
+		InitializeCriticalSection(&CacheLock);
+		CacheLockInited = true;
+	}
+
+	_wfopen_s(&File, CacheFileName, L"rb");
+	if (File == NULL)
+		return;
+
+	if (fread(Magic, 1, 4, File) != 4 || memcmp(Magic, SIGCACHE_MAGIC, 4) != 0
+		|| fread(&Version, sizeof(Version), 1, File) != 1 || Version != SIGCACHE_VERSION
+		|| fread(&Flags, sizeof(Flags), 1, File) != 1
+		|| fread(&Count, sizeof(Count), 1, File) != 1)
+	{
+		fclose(File);
+		return;
+	}
+	if (((Flags & 1) != 0) != LegacyKernel)
+	{
+		// Signatures in the file came from the other kernel; not comparable.
+		fclose(File);
+		return;
+	}
+
+	for (a = 0; a < Count; a++)
+	{
+		ULONGLONG FileSize;
+		__time64_t Mtime;
+		DWORD IndexHigh, IndexLow;
+		unsigned int Crc, Sum, PathChars;
+		WCHAR Path[_MAX_PATH * 2];
+
+		if (fread(&FileSize, sizeof(FileSize), 1, File) != 1
+			|| fread(&Mtime, sizeof(Mtime), 1, File) != 1
+			|| fread(&IndexHigh, sizeof(IndexHigh), 1, File) != 1
+			|| fread(&IndexLow, sizeof(IndexLow), 1, File) != 1
+			|| fread(&Crc, sizeof(Crc), 1, File) != 1
+			|| fread(&Sum, sizeof(Sum), 1, File) != 1
+			|| fread(&PathChars, sizeof(PathChars), 1, File) != 1
+			|| PathChars >= _MAX_PATH * 2
+			|| fread(Path, sizeof(WCHAR), PathChars, File) != PathChars)
+		{
+			break; // Truncated cache; keep what we got.
+		}
+		Path[PathChars] = L'\0';
+		StoreLocked(Path, FileSize, Mtime, IndexHigh, IndexLow, Crc, Sum);
+	}
+	fclose(File);
+}
+
+//--------------------------------------------------------------------------------
+// Write the cache back out, including entries carried over from the load.
+//--------------------------------------------------------------------------------
+void SigCacheSave(const WCHAR* CacheFileName, bool LegacyKernel)
+{
+	FILE* File = NULL;
+	unsigned int Version = SIGCACHE_VERSION;
+	unsigned int Flags = LegacyKernel ? 1 : 0;
+	ULONGLONG Count = CacheEntries;
+	size_t a;
+
+	_wfopen_s(&File, CacheFileName, L"wb");
+	if (File == NULL)
+	{
+		fwprintf(stderr, L"Unable to write signature cache '%s'.\n", CacheFileName);
+		return;
+	}
+	fwrite(SIGCACHE_MAGIC, 1, 4, File);
+	fwrite(&Version, sizeof(Version), 1, File);
+	fwrite(&Flags, sizeof(Flags), 1, File);
+	fwrite(&Count, sizeof(Count), 1, File);
+
+	for (a = 0; a < CacheTableSize; a++)
+	{
+		CacheEntry_t* Entry = &CacheTable[a];
+		unsigned int PathChars;
+		if (Entry->Path == NULL)
+			continue;
+		PathChars = (unsigned int)wcslen(Entry->Path);
+		fwrite(&Entry->FileSize, sizeof(Entry->FileSize), 1, File);
+		fwrite(&Entry->Mtime, sizeof(Entry->Mtime), 1, File);
+		fwrite(&Entry->IndexHigh, sizeof(Entry->IndexHigh), 1, File);
+		fwrite(&Entry->IndexLow, sizeof(Entry->IndexLow), 1, File);
+		fwrite(&Entry->Crc, sizeof(Entry->Crc), 1, File);
+		fwrite(&Entry->Sum, sizeof(Entry->Sum), 1, File);
+		fwrite(&PathChars, sizeof(PathChars), 1, File);
+		fwrite(Entry->Path, sizeof(WCHAR), PathChars, File);
+	}
+	fclose(File);
+}